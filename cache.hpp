@@ -0,0 +1,125 @@
+#ifndef _CACHE_HPP_
+#define _CACHE_HPP_
+
+#include "table.hpp"
+
+// modification and change time of a directory
+// any entry added, removed or renamed moves both forward
+struct DirStamp{
+    struct timespec mtime = {0, 0};
+    struct timespec ctime = {0, 0};
+
+    static DirStamp of(const struct stat& st){
+        DirStamp stamp;
+#ifdef __APPLE__
+        stamp.mtime = st.st_mtimespec;
+        stamp.ctime = st.st_ctimespec;
+#else
+        stamp.mtime = st.st_mtim;
+        stamp.ctime = st.st_ctim;
+#endif
+        return stamp;
+    }
+
+    bool operator==(const DirStamp& o) const {
+        return mtime.tv_sec == o.mtime.tv_sec &&
+            mtime.tv_nsec == o.mtime.tv_nsec &&
+            ctime.tv_sec == o.ctime.tv_sec &&
+            ctime.tv_nsec == o.ctime.tv_nsec;
+    }
+};
+
+// a loaded directory as it was left
+struct Listing{
+    std::string path;
+    DirStamp stamp;
+    // when the entries were read
+    time_t loaded = 0;
+    EntryTable files;
+    std::vector<size_t> filterResult;
+    std::string filter;
+    int sortMethod = 0;
+    bool ranked = false;
+    long cur = 0;
+    size_t scroll = 0;
+    // sizes are disk usage, see Explorer::toggleUsage()
+    bool usage = false;
+
+    size_t memory(){
+        return sizeof(Listing) + path.capacity() + filter.capacity() +
+            files.memory() + filterResult.capacity() * sizeof(size_t);
+    }
+
+    // a directory changed within the same second it was read may have
+    // been changed again without moving its timestamps, same trick as
+    // git's racily clean index entries
+    bool validFor(const DirStamp& current){
+        return stamp == current &&
+            stamp.mtime.tv_sec < loaded && stamp.ctime.tv_sec < loaded;
+    }
+};
+
+// least recently used listings, keyed by real path
+// bounded by the estimated memory of the listings it holds
+class ListingCache{
+    std::list<Listing> lru;
+    std::unordered_map<std::string, std::list<Listing>::iterator> index;
+    size_t bytes = 0;
+    size_t budget;
+
+    void evict(){
+        while (bytes > budget && lru.size()){
+            auto& last = lru.back();
+            FElog.add("cache evict: " + last.path);
+            bytes -= last.memory();
+            index.erase(last.path);
+            lru.pop_back();
+        }
+    }
+
+    public:
+    ListingCache(size_t budget): budget(budget) {}
+
+    void put(Listing&& listing){
+        erase(listing.path);
+        if (listing.memory() > budget){
+            return;
+        }
+        bytes += listing.memory();
+        lru.push_front(std::move(listing));
+        index[lru.front().path] = lru.begin();
+        evict();
+    }
+
+    // cached listing of path if it is still up to date and its sizes
+    // are disk usage or not as asked for
+    bool contains(const std::string& path, const DirStamp& stamp,
+        bool usage)
+    {
+        auto found = index.find(path);
+        return found != index.end() && found->second->validFor(stamp) &&
+            found->second->usage == usage;
+    }
+
+    // remove the listing of path from the cache and hand it over
+    Listing take(const std::string& path){
+        auto found = index.find(path);
+        bytes -= found->second->memory();
+        Listing listing = std::move(*found->second);
+        lru.erase(found->second);
+        index.erase(found);
+        return listing;
+    }
+
+    void erase(const std::string& path){
+        auto found = index.find(path);
+        if (found == index.end()){
+            return;
+        }
+        bytes -= found->second->memory();
+        lru.erase(found->second);
+        index.erase(found);
+    }
+};
+
+#endif
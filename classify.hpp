@@ -0,0 +1,176 @@
+#ifndef _CLASSIFY_HPP_
+#define _CLASSIFY_HPP_
+
+#include "config.hpp"
+#include "log.hpp"
+#include "pool.hpp"
+
+static inline magic_t magicOpen(){
+    magic_t cookie = magic_open(
+        MAGIC_NO_CHECK_APPTYPE | MAGIC_NO_CHECK_COMPRESS |
+        MAGIC_NO_CHECK_ELF | MAGIC_NO_CHECK_ENCODING |
+        MAGIC_NO_CHECK_TOKENS );
+    if (cookie == NULL) {
+        exitError(
+            "Explorer",
+            "unable to initialize magic library");
+        return NULL;
+    }
+
+    if (magic_load(cookie, NULL) != 0) {
+        exitError(
+            "cannot load magic database",
+            magic_error(cookie));
+        magic_close(cookie);
+        return NULL;
+    }
+    return cookie;
+}
+
+static inline std::string magicDescribe(magic_t cookie, const std::string& path){
+    if (!cookie){
+        return "";
+    }
+    const char* magic = magic_file(cookie, path.c_str());
+    if (!magic){
+        const char* error = magic_error(cookie);
+        return error ? error : "";
+    }
+    return magic;
+}
+
+// runs libmagic on worker threads
+// a magic_t cookie cannot be shared between threads so each worker opens
+// its own. Visible entries are queued as urgent and jump ahead of the rest.
+// Jobs belong to a generation (one directory listing); starting a new one
+// drops everything queued for the old listing.
+class Classifier{
+    public:
+    struct Result{
+        size_t index;
+        std::string magic;
+    };
+
+    private:
+    struct Job{
+        size_t generation;
+        size_t index;
+        std::string path;
+    };
+
+    std::vector<std::thread> threads;
+    std::deque<Job> urgent;
+    std::deque<Job> background;
+    std::vector<Result> results;
+    // indices queued as urgent in this generation
+    // background jobs for these are skipped
+    std::unordered_set<size_t> urgentSeen;
+    size_t generation = 0;
+    size_t running = 0;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    void work(){
+        magic_t cookie = magicOpen();
+        while (true){
+            Job job;
+            {
+                std::unique_lock lock(mutex);
+                cv.wait(lock, [&](){
+                    return stopping || urgent.size() || background.size();
+                });
+                if (stopping){
+                    break;
+                }
+                if (urgent.size()){
+                    job = std::move(urgent.front());
+                    urgent.pop_front();
+                }else{
+                    job = std::move(background.front());
+                    background.pop_front();
+                    if (urgentSeen.contains(job.index)){
+                        continue;
+                    }
+                }
+                running++;
+            }
+
+            auto magic = magicDescribe(cookie, job.path);
+
+            std::lock_guard lock(mutex);
+            running--;
+            if (job.generation == generation){
+                results.push_back({job.index, std::move(magic)});
+            }
+        }
+        if (cookie){
+            magic_close(cookie);
+        }
+    }
+
+    public:
+    Classifier(size_t n){
+        for (size_t i = 0; i < n; i++){
+            threads.emplace_back([this](){ work(); });
+        }
+    }
+
+    ~Classifier(){
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& t : threads){
+            t.join();
+        }
+    }
+
+    // forget everything queued for the previous listing
+    void reset(){
+        std::lock_guard lock(mutex);
+        generation++;
+        urgent.clear();
+        background.clear();
+        results.clear();
+        urgentSeen.clear();
+    }
+
+    void push(size_t index, const std::string& path, bool visible){
+        {
+            std::lock_guard lock(mutex);
+            if (visible){
+                if (!urgentSeen.insert(index).second){
+                    return;
+                }
+                urgent.push_back({generation, index, path});
+            }else{
+                background.push_back({generation, index, path});
+            }
+        }
+        cv.notify_one();
+    }
+
+    // allow index to be queued as urgent again, after it changed
+    void forget(size_t index){
+        std::lock_guard lock(mutex);
+        urgentSeen.erase(index);
+    }
+
+    // results finished since the last call
+    std::vector<Result> take(){
+        std::lock_guard lock(mutex);
+        std::vector<Result> finished;
+        finished.swap(results);
+        return finished;
+    }
+
+    bool busy(){
+        std::lock_guard lock(mutex);
+        return running || urgent.size() || background.size() ||
+            results.size();
+    }
+};
+
+#endif
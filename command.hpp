@@ -2,6 +2,7 @@
 #define _COMMAND_HPP_
 
 #include "explorer.hpp"
+#include "fileop.hpp"
 
 static inline std::pair<std::string, std::vector<std::string>>
 parse(const std::string& str){
@@ -53,35 +54,30 @@ parse(const std::string& str){
         } \
     } while(0)
 
-static inline void runProcess(std::string command){
-    command += " 2>&1";
-    FElog.add("run proess: " + command);
-    auto fd_pipe = popen(command.c_str(), "r");
-
-    std::string error;
-    char readbuffer[1025];
-    while(fread(readbuffer, 1, 1024, fd_pipe)){
-        error += readbuffer;
-    }
-
-    pclose(fd_pipe);
-
-    if (error != ""){
-        exitError(command, error);
-    }
+// move in the background, see Jobs
+static inline void mv(Explorer& explorer, const std::string& name,
+    const std::vector<std::string>& from, const std::string& to)
+{
+    FElog.add("move " + std::to_string(from.size()) + " files to " + to);
+    explorer.runJob(name, [=](OpProgress& progress){
+        return moveFiles(from, to, progress);
+    });
+    // the selected paths are gone once the job is done
+    explorer.clearSelection();
 }
 
-// TODO: escape spaces and ' and " in paths
-static inline void
-mv(std::vector<std::string> from, std::string to){
-    std::string cmd = "mv ";
-    for (auto& s : from){
-        cmd += escapePath(s);
-        cmd += ' ';
+// copy the yanked files into the current directory in the background
+static inline void paste(Explorer& explorer){
+    const auto& yanked = explorer.getYanked();
+    if (!yanked.size()){
+        exitError("paste", "nothing yanked");
+        return;
     }
-    cmd += escapePath(to);
-    FElog.add("Call shell");
-    runProcess(cmd);
+    auto to = explorer.getcwd();
+    FElog.add("paste " + std::to_string(yanked.size()) + " files into " + to);
+    explorer.runJob("paste", [=](OpProgress& progress){
+        return copyFiles(yanked, to, progress);
+    });
 }
 
 static inline void
@@ -101,8 +97,13 @@ command(const std::string& input, Explorer& explorer){
             exitError("rm", "no selection");
             return;
         }
-        mv(paths, TRASH);
-        explorer.cd(explorer.getcwd());
+        auto trash = explorer.absolutePath(TRASH);
+        // a single file would be renamed to the trash otherwise
+        if (mkdir(trash.c_str(), 0700) == -1 && errno != EEXIST){
+            exitError(trash);
+            return;
+        }
+        mv(explorer, "rm", paths, trash);
         return;
     }
     if (cmd == "mv"){
@@ -112,8 +113,26 @@ command(const std::string& input, Explorer& explorer){
             exitError("rm", "no selection");
             return;
         }
-        mv(paths, args[0]);
-        explorer.cd(explorer.getcwd());
+        mv(explorer, "mv", paths, explorer.absolutePath(args[0]));
+        return;
+    }
+    // list every background job in the footer, or only the oldest
+    if (cmd == "jobs"){
+        explorer.toggleJobs();
+        return;
+    }
+    // cancel job n, or all jobs
+    if (cmd == "cancel"){
+        if (args.size() > 1){
+            exitError("cancel requires 0 or 1 args");
+            return;
+        }
+        size_t id = args.size() ? strtoul(args[0].c_str(), NULL, 10) : 0;
+        if (args.size() && !id){
+            exitError("cancel", "not a job: " + args[0]);
+            return;
+        }
+        explorer.cancelJob(id);
         return;
     }
     if (cmd == "cwd"){
@@ -126,6 +145,15 @@ command(const std::string& input, Explorer& explorer){
         }
         return;
     }
+    // index a tree for recursive search, or refresh the index
+    if (cmd == "index"){
+        if (args.size() > 1){
+            exitError("index requires 0 or 1 args");
+            return;
+        }
+        explorer.buildIndex(args.size() ? args[0] : "");
+        return;
+    }
     // open in Finder / default file explorer
     if (cmd == "opendir"){
         system(("open " + explorer.getcwd()).c_str());
@@ -1,6 +1,7 @@
 #ifndef _CONFIG_HPP_
 #define _CONFIG_HPP_
 
+#include <cstddef>
 
 static const char* TERM = "dtach -A /tmp/fe-dtach-session -E";
 static const char* EDITOR = "nvim";
@@ -11,7 +12,28 @@ static const bool USE_MAGIC = true;
 
 static const float COL_WIDTHS[] = { 0.8, 0.2 };
 
-static const bool ENABLE_LOGGING = false;
+// number of background worker threads, 0 uses one per cpu
+static const unsigned WORKER_THREADS = 0;
+// memory budget in bytes of directory listings kept for going back
+static const size_t LISTING_CACHE_SIZE = 64 << 20;
+// milliseconds between redraws while work is running in the background
+static const int REFRESH_INTERVAL = 50;
+// max number of lstat requests in flight when loading a directory
+static const unsigned STAT_BATCH_SIZE = 256;
+// max number of files copied at once when pasting, on threads of their
+// own
+static const unsigned COPY_IN_FLIGHT = 16;
+// max number of file operations (mv, rm, paste) running at once, see :jobs
+static const unsigned JOB_THREADS = 2;
+// memory budget in bytes of earlier filter results kept while typing
+static const size_t FILTER_STACK_SIZE = 32 << 20;
+// number of best matches listed for a fuzzy query
+static const size_t FUZZY_TOP_K = 1000;
+// file index for recursive search, see :index
+static const char* INDEX_FILE = "~/.cache/fe-index";
+
+// a macro so that main.cpp replaces operator new only for the log
+#define ENABLE_LOGGING false
 static const bool PRINT_LOG_ON_SEG_VAULT = false;
 static const bool FORCE_EXIT_ON_ERROR = false;
 
@@ -30,6 +30,8 @@ class Controller{
     }mode = NORMAL;
     
     bool resize = false;
+    // readInput() returned because of a key, not background results
+    bool input = false;
   
     size_t getRepeat(){
         size_t repeat = 0;
@@ -185,20 +187,44 @@ class Controller{
         }
     }
 
-    Controller& readInput(){
+    // wait for a key
+    // also wakes up when the listed directory changes, and every
+    // REFRESH_INTERVAL while explorer has background work; returns without
+    // input if that changed the screen
+    Controller& readInput(Explorer& explorer){
         resize = false;
+        input = false;
         int ch;
 
         do {
+            // keys ncurses already buffered are not seen by poll()
+            timeout(0);
             ch = getch();
+            if (ch == ERR){
+                if (explorer.poll()){
+                    return *this;
+                }
+                struct pollfd fds[] = {
+                    { STDIN_FILENO, POLLIN, 0 },
+                    { explorer.watchFd(), POLLIN, 0 },
+                };
+                poll(fds, 2, explorer.busy() ? REFRESH_INTERVAL : -1);
+                continue;
+            }
             FElog.add("Input:" + std::to_string(ch));
             if (ch == KEY_RESIZE){
                 resize = true;
                 ch = buf.size() ? -1 : ESC;
             }
+            // terminals whose backspace is ^H come through keypad()
+            if (ch == KEY_BACKSPACE){
+                ch = DEL;
+            }
         }while(ch == -1);
 
+        explorer.poll();
         buf.push_back(ch);
+        input = true;
         return *this;
     }
 
@@ -207,6 +233,9 @@ class Controller{
     }
 
     int control(Explorer& explorer){
+        if (!input){
+            return 1;
+        }
         // cancel command
         auto verb = getVerb();
         size_t repeat = getRepeat();
@@ -216,7 +245,10 @@ class Controller{
             case NORMAL:
             ARM_START()
             // esc - clear command
+            // also stops loading a directory or a recursive search
             ARM(has(verb, ESC), {
+                explorer.cancelLoad();
+                explorer.cancelSearch();
                 buf.clear();
             })
             // quit
@@ -249,17 +281,28 @@ class Controller{
             })
             // select
             ARM(verb == "s", {
-                bool& s = explorer.select(explorer.getCur());
-                s = !s;
+                explorer.toggleSelect(explorer.getCur());
             })
             // clear selection
             ARM(verb == "S", {
                 explorer.clearSelection();
             })
+            // yank
+            ARM(verb == "y", {
+                msg = "yanked " + std::to_string(explorer.yank()) + " files";
+            })
+            // paste
+            ARM(verb == "p", {
+                paste(explorer);
+            })
+            // disk usage mode
+            ARM(verb == "D", {
+                explorer.toggleUsage();
+            })
             // refresh
             ARM(verb == "R", {
                 FElog.add("Refresh");
-                explorer.cd(explorer.getcwd());
+                explorer.refresh();
             })
             // goto home directory
             ARM(verb == "~", {
@@ -317,10 +360,9 @@ class Controller{
                 bool beforeSmaller = before < dest;
                 long start = beforeSmaller ? before : dest;
                 long end = beforeSmaller ? dest : before;
-                for (long i = start; i < end; i++){
-                    FElog.add("select index: " + std::to_string(i));
-                    explorer.select(i) = !explorer.select(i);
-                }
+                FElog.add("select index: " + std::to_string(start) +
+                    " to " + std::to_string(end));
+                explorer.toggleSelect(start, end);
             })
             // open files
             ARM(verb == "\r", {
@@ -0,0 +1,241 @@
+#ifndef _DU_HPP_
+#define _DU_HPP_
+
+#include "walk.hpp"
+
+// disk usage of a directory tree on several threads, see WorkStealing
+// the total of a directory is known once its last subdirectory is done,
+// which adds it to its parent, so totals complete bottom up while the
+// walk is still running. Files with several links count once, where they
+// are seen first. The walk stays on the filesystem of its base.
+class DiskUsage{
+    public:
+    struct Total{
+        // relative to the base, directories end with '/', the base is ""
+        std::string path;
+        off_t bytes;
+    };
+
+    private:
+    struct Node{
+        std::shared_ptr<Node> parent;
+        std::string path;
+        std::atomic<off_t> bytes = 0;
+        // subdirectories not done yet, and one for reading the node itself
+        std::atomic<size_t> left = 1;
+    };
+
+    // totals since the last take()
+    struct Worker{
+        std::mutex mutex;
+        std::vector<Total> totals;
+    };
+
+    DirReader base;
+    dev_t device = 0;
+    // totals of directories known already, they are not read again
+    std::unordered_map<std::string, off_t> known;
+    // files with more than one link counted so far
+    std::mutex linksMutex;
+    std::set<std::pair<dev_t, ino_t>> links;
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    std::atomic<size_t> dirCount = 0;
+    std::atomic<off_t> byteCount = 0;
+
+    // last so that its threads stop before the members above go away
+    WorkStealing<std::shared_ptr<Node>> walk;
+
+    void report(size_t w, const std::string& path, off_t bytes){
+        std::lock_guard lock(workers[w]->mutex);
+        workers[w]->totals.push_back({ path, bytes });
+    }
+
+    // first time a file with several links is seen
+    bool firstLink(const Stat& st){
+        std::lock_guard lock(linksMutex);
+        return links.insert({ st.dev, st.ino }).second;
+    }
+
+    // one thing less left of node; the node that runs out is done and
+    // counts for its parent
+    void finish(size_t w, std::shared_ptr<Node> node){
+        while (--node->left == 0){
+            report(w, node->path, node->bytes);
+            auto parent = node->parent;
+            if (!parent){
+                return;
+            }
+            parent->bytes += node->bytes;
+            node = parent;
+        }
+    }
+
+    void visit(size_t w, std::shared_ptr<Node>& node){
+        const auto& rel = node->path;
+        DirReader dir(base.getfd(), rel.length() ? rel.c_str() : ".");
+        std::vector<std::shared_ptr<Node>> children;
+        if (dir.ok()){
+            StatBatch batch;
+            auto onEntry = [&](const char* name, unsigned char){
+                batch.add(dir.getfd(), name, Stat::TYPE | Stat::USAGE);
+            };
+            while (!walk.cancelling() && dir.next(onEntry));
+            // a directory cut short never finishes, so no total is wrong
+            if (walk.cancelling()){
+                return;
+            }
+            off_t bytes = 0;
+            batch.run([&](size_t i, Stat st){
+                if (st.error){
+                    return;
+                }
+                const auto& name = batch.name(i);
+                if (!S_ISDIR(st.mode)){
+                    if (st.nlink > 1 && !firstLink(st)){
+                        st.usage = 0;
+                    }
+                    bytes += st.usage;
+                    // files of the base are listed with their usage
+                    if (!rel.length()){
+                        report(w, name, st.usage);
+                    }
+                    return;
+                }
+                auto path = rel + name + '/';
+                auto found = known.find(path);
+                if (found != known.end() || st.dev != device){
+                    off_t total = found != known.end() ?
+                        found->second : st.usage;
+                    bytes += total;
+                    report(w, path, total);
+                    return;
+                }
+                auto child = std::make_shared<Node>();
+                child->parent = node;
+                child->path = std::move(path);
+                child->bytes = st.usage;
+                children.push_back(std::move(child));
+            });
+            node->bytes += bytes;
+            byteCount += bytes;
+        }
+        dirCount++;
+        node->left += children.size();
+        walk.push(w, children);
+        finish(w, node);
+    }
+
+    public:
+    // path is relative to dirfd; known holds totals of directories below
+    // it by path relative to it, ending with '/'
+    DiskUsage(int dirfd, const char* path,
+        std::unordered_map<std::string, off_t>&& known):
+        base(dirfd, path), known(std::move(known)) {}
+
+    DiskUsage(const DiskUsage&) = delete;
+    DiskUsage& operator=(const DiskUsage&) = delete;
+
+    bool ok(){
+        return base.ok();
+    }
+
+    // start walking the tree on n threads
+    void start(size_t n = workerCount()){
+        std::vector<std::shared_ptr<Node>> root;
+        struct stat st;
+        if (ok() && fstat(base.getfd(), &st) == 0){
+            device = st.st_dev;
+            root.push_back(std::make_shared<Node>());
+            root[0]->bytes = (off_t)st.st_blocks * 512;
+            for (size_t i = 0; i < std::max<size_t>(n, 1); i++){
+                workers.push_back(std::make_unique<Worker>());
+            }
+        }
+        walk.start(n, root, [this](size_t w, std::shared_ptr<Node>& node){
+            visit(w, node);
+        });
+    }
+
+    // stop after the directories being read
+    void cancel(){
+        walk.cancel();
+    }
+
+    // wait up to ms milliseconds for the walk to finish
+    bool wait(int ms){
+        return walk.wait(ms);
+    }
+
+    // every directory is read, or the walk was cancelled
+    bool done(){
+        return walk.done();
+    }
+
+    // directories read and bytes counted so far
+    size_t dirs(){
+        return dirCount;
+    }
+    off_t bytes(){
+        return byteCount;
+    }
+
+    // totals found since the last call, a directory only once it is done
+    std::vector<Total> take(){
+        std::vector<Total> merged;
+        for (auto& w : workers){
+            std::lock_guard lock(w->mutex);
+            for (auto& t : w->totals){
+                merged.push_back(std::move(t));
+            }
+            w->totals.clear();
+        }
+        return merged;
+    }
+};
+
+// disk usage of directories by real path ending with '/'
+// sorted so that those below a directory are found without a scan
+class UsageCache{
+    std::map<std::string, off_t> totals;
+
+    public:
+    void put(const std::string& dir, off_t bytes){
+        totals[dir] = bytes;
+    }
+
+    // total of dir, -1 if unknown
+    off_t find(const std::string& dir){
+        auto found = totals.find(dir);
+        return found == totals.end() ? -1 : found->second;
+    }
+
+    // totals strictly below dir, by path relative to it
+    std::unordered_map<std::string, off_t> below(const std::string& dir){
+        std::unordered_map<std::string, off_t> result;
+        for (auto it = totals.upper_bound(dir);
+            it != totals.end() && it->first.starts_with(dir); it++)
+        {
+            result[it->first.substr(dir.length())] = it->second;
+        }
+        return result;
+    }
+
+    // dir changed: forget it, everything below it and every directory
+    // above it, whose totals include it
+    void forget(const std::string& dir){
+        auto it = totals.lower_bound(dir);
+        while (it != totals.end() && it->first.starts_with(dir)){
+            it = totals.erase(it);
+        }
+        for (size_t slash = dir.rfind('/', dir.length() - 2);
+            slash != std::string::npos && slash > 0;
+            slash = dir.rfind('/', slash - 1))
+        {
+            totals.erase(dir.substr(0, slash + 1));
+        }
+        totals.erase("/");
+    }
+};
+
+#endif
@@ -1,120 +1,668 @@
 #ifndef _EXPLORER_HPP_
 #define _EXPLORER_HPP_
 
-#include "file.hpp"
+#include "cache.hpp"
+#include "scan.hpp"
+#include "watch.hpp"
+#include "walk.hpp"
+#include "index.hpp"
+#include "query.hpp"
+#include "sort.hpp"
+#include "select.hpp"
+#include "jobs.hpp"
+#include "du.hpp"
 
 class Explorer{
-    magic_t magicCookie;
-    std::vector<File> files;
+    EntryTable files;
     std::vector<size_t> filterResult;
+    // changes whenever filterResult does
+    uint64_t listVersion = 0;
+    // files whose row may look different since the last frame while
+    // filterResult stayed the same, e.g. once they are classified
+    std::vector<size_t> changedRows;
     std::vector<std::string> history;
     long cur = 0;
-    enum Sort{
-        NAME_A = 0,
-        NAME_D,
-        SIZE_A,
-        SIZE_D,
-        NONE,
-    }sortMethod = NONE;
+    size_t scroll = 0;
+    // query of the current filter, empty if none
+    std::string filter;
+    Query query;
+    // results of shorter queries typed before the current filter, newest
+    // last; any change to the listing or its order drops them
+    struct FilterState{
+        std::string filter;
+        std::vector<size_t> result;
+    };
+    std::deque<FilterState> filterStack;
+    size_t filterStackBytes = 0;
+    // filterResult is ordered by fuzzy score instead of sortMethod
+    bool ranked = false;
+    // directory the entries were read from and its timestamps then
+    // empty while files hold recursive search results
+    std::string listingPath;
+    DirStamp stamp;
+    time_t loaded = 0;
+    ListingCache cache {LISTING_CACHE_SIZE};
+    // follows changes in the listed directory
+    DirWatch watcher;
+    // reads the listed directory while it is still loading
+    std::unique_ptr<Loader> loader;
+    // recursive search still walking the tree
+    std::unique_ptr<TreeWalk> search;
+    std::string searchBase;
+    // indexed trees are searched without walking them
+    FileIndex index;
+    std::unique_ptr<IndexBuilder> indexer;
+    Classifier classifier {workerCount()};
+    // file indices drawn in the last frame
+    // a vector so that it keeps its memory from frame to frame
+    std::vector<size_t> visible;
+    // selected entries of files, and by path those of listings that
+    // were left; they move from one to the other as listings are left
+    // and shown again
+    Selection selection;
+    SelectedPaths selectedElsewhere;
+    // paths of the files to paste, see yank()
+    std::vector<std::string> yanked;
+    // file operations running in the background
+    Jobs jobs;
+    // footer lists every job instead of the oldest one, see :jobs
+    bool showJobs = false;
+    // sizes are disk usage, of directories with everything below them
+    bool usageMode = false;
+    // computes the disk usage of the listing, usageFor is its path
+    // keys of usageCache are made with joinPath(dir, ""), see UsageCache
+    std::unique_ptr<DiskUsage> usage;
+    std::string usageFor;
+    // disk usage of every directory walked so far
+    UsageCache usageCache;
+    // entries changed since the last poll(), as keys of usageCache
+    std::vector<std::string> usageForgotten;
+    // sort keys and cached orders of files
+    Sorter sorter;
+    Sorter::Order sortMethod = Sorter::NONE;
 
-    static bool sortNameA(const File& l, const File& r){
-        return l.name < r.name;
-    }
-    static bool sortNameD(const File& l, const File& r){
-        return l.name > r.name;
-    }
-    static bool sortSizeA(const File& l, const File& r){
-        return l.size < r.size;
-    }
-    static bool sortSizeD(const File& l, const File& r){
-        return l.size > r.size;
+    // l goes before r in the current sort order
+    bool sortFunction(size_t l, size_t r){
+        return sorter.less(files, sortMethod, l, r);
     }
     
-    auto sortFunction(auto&& l, auto&& r){
-        switch (sortMethod){
-            case NAME_A: return sortNameA(l, r);
-            case NAME_D: return sortNameD(l, r);
-            case SIZE_A: return sortSizeA(l, r);
-            case SIZE_D: return sortSizeD(l, r);
-            default:     return sortNameA(l, r);  // default
+    void clearFilterStack(){
+        filterStack.clear();
+        filterStackBytes = 0;
+    }
+
+    // keep the current result to return to it when the query shrinks
+    // oldest results go first once FILTER_STACK_SIZE is exceeded
+    void pushFilterState(){
+        filterStackBytes += filterResult.size() * sizeof(size_t);
+        filterStack.push_back({filter, filterResult});
+        while (filterStackBytes > FILTER_STACK_SIZE && filterStack.size()){
+            auto& front = filterStack.front();
+            filterStackBytes -= front.result.size() * sizeof(size_t);
+            filterStack.pop_front();
         }
     }
-    
+
     // sort filterResult
-    auto sort(){
-        std::sort(filterResult.begin(), filterResult.end(),
-            [&](size_t l, size_t r){
-                return sortFunction(files.at(l), files.at(r));
-            });
+    // a few matches out of many files are sorted on their own, anything
+    // else is picked out of the cached order of all files
+    void sort(){
+        clearFilterStack();
+        ranked = false;
+        listVersion++;
+        if (!sorter.cached(files, sortMethod) &&
+            filterResult.size() < files.size() / 8)
+        {
+            sorter.sort(files, sortMethod, filterResult);
+        }else{
+            sorter.select(files, sortMethod, filterResult);
+        }
     }
     
-    std::string getRealPath(std::string path){
-        // expand ~ to home directory
+    // expand ~ to home directory
+    std::string expandHome(std::string path){
         if (path == "~" || path.starts_with("~/")){
             path.erase(0, 1);
             std::string home = getHomeDir();
             path = home + path;
         }
-        // append current working directory
-        if (!path.starts_with("/")){
-            path = getcwd() + path;
-        }
+        return path;
+    }
+
+    // resolve path through an O_PATH handle
+    // the handle is left open so the directory can be read through it
+    // without walking the path again; handle is -1 on error
+    std::string getRealPath(std::string path, int& handle){
+        path = absolutePath(path);
 
         char buf[PATH_MAX];
-        FILE* pathfile = fopen(path.c_str(), "r");
-        if (!pathfile){
+#ifdef __linux__
+        handle = open(path.c_str(), O_PATH | O_CLOEXEC);
+        if (handle == -1){
+            exitError(path);
+            return "";
+        }
+        auto fdpath = "/proc/self/fd/" + std::to_string(handle);
+        ssize_t length = readlink(fdpath.c_str(), buf, PATH_MAX - 1);
+        if (length == -1){
+            // no /proc, resolve the path string instead
+            if (!realpath(path.c_str(), buf)){
+                exitError(path);
+                close(handle);
+                handle = -1;
+                return "";
+            }
+        }else{
+            buf[length] = 0;
+        }
+#else
+        handle = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (handle == -1){
             exitError(path);
             return "";
         }
-        if (fcntl(fileno(pathfile), F_GETPATH, buf) == -1) {
+        if (fcntl(handle, F_GETPATH, buf) == -1) {
             exitError(path);
-            fclose(pathfile);
+            close(handle);
+            handle = -1;
             return "";
         }
-        fclose(pathfile);
+#endif
         return buf;
     }
     
-    void loadEntries(DIR* dir, const std::string& path)
-    {
-        struct dirent* entry;
-        size_t i = 0;
-        while((entry = readdir(dir))){
-            // turn of libmagic when doing recursive search
-            File file (entry->d_name, path, USE_MAGIC);
-            files.push_back(file);
-            filterResult.push_back(i++);
+    // move entries the loader has read so far into the listing
+    // returns true if the listing changed
+    bool loadEntries(){
+        if (!loader){
+            return false;
         }
+        // checked first so entries read in between are not left behind
+        bool finished = loader->done();
+        auto entries = loader->take();
+
+        size_t first = files.size();
+        std::vector<size_t> added;
+        for (auto& e : entries){
+            // listings have their directory at index 0
+            size_t i = files.add(0, e.name, e.stat, loader->getfd());
+            if (query.match(files.displayName(i))){
+                added.push_back(i);
+            }
+        }
+        adoptSelections(first, files.size());
+        mergeEntries(added);
+        if (USE_MAGIC){
+            for (size_t i = first; i < files.size(); i++){
+                classifier.push(i, files.path(i), false);
+            }
+        }
+
+        if (finished){
+            FElog.add("loaded " + std::to_string(files.size()) + " entries");
+            loader.reset();
+        }
+        return entries.size() || finished;
     }
-    
-    void filesClear(){
-        files.clear();
+
+    // merge entries into the sorted filterResult
+    // the cursor stays on the file it was on
+    void mergeEntries(std::vector<size_t>& added){
+        if (!added.size()){
+            return;
+        }
+        clearFilterStack();
+        listVersion++;
+        long curFile = filterResult.size() ? filterResult[cur] : -1;
+        if (ranked){
+            filterResult.insert(filterResult.end(), added.begin(), added.end());
+            rank();
+            keepCursorOn(curFile);
+            return;
+        }
+        auto cmp = [&](size_t l, size_t r){
+            return sortFunction(l, r);
+        };
+        sorter.sort(files, sortMethod, added);
+        size_t mid = filterResult.size();
+        filterResult.insert(filterResult.end(), added.begin(), added.end());
+        std::inplace_merge(filterResult.begin(),
+            filterResult.begin() + mid, filterResult.end(), cmp);
+        keepCursorOn(curFile);
+    }
+
+    // move the cursor to file index i if it is still listed
+    void keepCursorOn(long i){
+        if (i == -1){
+            return;
+        }
+        auto pos = std::find(filterResult.begin(), filterResult.end(), i);
+        if (pos != filterResult.end()){
+            cur = pos - filterResult.begin();
+        }else{
+            setCur(cur);
+        }
+    }
+
+    // order filterResult by fuzzy score, best first, and keep only the
+    // FUZZY_TOP_K best; the rest is never sorted
+    void rank(){
+        clearFilterStack();
+        ranked = true;
+        listVersion++;
+        sorter.prepare(files, Sorter::NAME_A);
+        bool flat = files.flat();
+        std::vector<std::pair<int, size_t>> scored;
+        for (auto i : filterResult){
+            int score = query.score(flat ?
+                files.name(i) : std::string_view(files.displayName(i)));
+            if (score >= 0){
+                scored.push_back({score, i});
+            }
+        }
+        // ties go to shorter paths, then to name order
+        auto better = [&](const auto& l, const auto& r){
+            if (l.first != r.first){
+                return l.first > r.first;
+            }
+            auto ln = files.relativeDir(l.second).length() +
+                files.name(l.second).length();
+            auto rn = files.relativeDir(r.second).length() +
+                files.name(r.second).length();
+            if (ln != rn){
+                return ln < rn;
+            }
+            return sorter.compareName(files, l.second, r.second) < 0;
+        };
+        size_t k = std::min(scored.size(), FUZZY_TOP_K);
+        std::nth_element(scored.begin(), scored.begin() + k, scored.end(),
+            better);
+        std::sort(scored.begin(), scored.begin() + k, better);
+        filterResult.clear();
+        for (size_t r = 0; r < k; r++){
+            filterResult.push_back(scored[r].second);
+        }
     }
     
-    bool matchName(
-        const std::string& filename,
-        const std::string& match)
-    {
-        bool useRegex = match.starts_with("r:");
-        FElog.add("Use regex:" + std::to_string(useRegex));
-
-        if (useRegex){
-            std::string expr = std::string(
-                match.begin() + 2, match.end());
-            FElog.add("Expression:" + expr);
-
-            try {
-                std::regex regex(expr,
-                    std::regex_constants::ECMAScript |
-                    std::regex_constants::icase);
-                return std::regex_match(filename, regex);
-            }catch(...){
-                return false;
+    // move matches the search has found so far into the list
+    // returns true if the list changed
+    bool loadMatches(){
+        if (!search){
+            return false;
+        }
+        bool finished = search->done();
+        auto result = search->take();
+
+        for (const auto& e : result.errors){
+            exitError(joinPath(searchBase, e), "");
+        }
+        std::vector<size_t> dirs;
+        for (const auto& d : result.dirs){
+            dirs.push_back(files.addDir(joinPath(searchBase, d)));
+        }
+        std::vector<size_t> added;
+        size_t first = files.size();
+        for (const auto& f : result.found){
+            // symlinks are read relative to the base, the directory
+            // they were found in may be closed by now
+            size_t i = files.add(dirs[f.dir], f.name, f.stat, -1);
+            if (files.type(i) == File::SYM){
+                auto rel = result.dirs[f.dir] + f.name;
+                files.setSym(i,
+                    File::resolveSymLink(search->getfd(), rel.c_str()));
             }
-        }else{
-            FElog.add("Expression:" + match);
-            return filename.find(match) != std::string::npos;
+            added.push_back(i);
+        }
+        adoptSelections(first, files.size());
+        // workers finish in any order, keep the list sorted
+        mergeEntries(added);
+
+        if (finished){
+            FElog.add("search found " + std::to_string(files.size()));
+            search.reset();
+        }
+        return added.size() || finished;
+    }
+
+    // put disk usage totals of the walk for usageFor into the cache, and
+    // into the sizes of the listing if it is still shown
+    // returns true if the list changed
+    bool applyUsage(const std::vector<DiskUsage::Total>& totals){
+        long curFile = filterResult.size() ? filterResult[cur] : -1;
+        bool resized = false;
+        for (const auto& t : totals){
+            bool dir = t.path == "" || t.path.ends_with('/');
+            if (dir){
+                usageCache.put(joinPath(usageFor, t.path), t.bytes);
+            }
+            if (usageFor != listingPath){
+                continue;
+            }
+            // entries of the listing itself, not those further down, and
+            // the listing as "."
+            auto name = t.path == "" ? std::string_view(".") :
+                std::string_view(t.path).substr(0, t.path.length() - dir);
+            if (name.find('/') != std::string_view::npos){
+                continue;
+            }
+            long i = files.find(0, name);
+            if (i == -1 || files.fileSize(i) == t.bytes){
+                continue;
+            }
+            selection.resize(i, files.fileSize(i), t.bytes);
+            files.setSize(i, t.bytes);
+            changedRows.push_back(i);
+            resized = true;
+        }
+        if (!resized){
+            return false;
+        }
+        sorter.changed();
+        // totals arrive in batches, sorting once beats moving each entry
+        if (Sorter::byStat(sortMethod) && !ranked){
+            sort();
+            keepCursorOn(curFile);
+        }
+        return true;
+    }
+
+    // walk the listed directory for disk usage; directories walked
+    // before show their totals at once and are not read again
+    void startUsage(){
+        usageFor = listingPath;
+        std::vector<DiskUsage::Total> cached;
+        for (size_t i = 0; i < files.size(); i++){
+            if (files.removed(i) || files.type(i) != File::DIR){
+                continue;
+            }
+            auto dir = std::string(files.name(i)) + '/';
+            off_t bytes = usageCache.find(joinPath(usageFor, dir));
+            if (bytes != -1){
+                cached.push_back({ dir, bytes });
+            }
+        }
+        applyUsage(cached);
+        FElog.add("disk usage of " + usageFor);
+        usage = std::make_unique<DiskUsage>(AT_FDCWD, usageFor.c_str(),
+            usageCache.below(joinPath(usageFor, "")));
+        usage->start();
+    }
+
+    // move totals the walk has found so far into the cache and the list
+    // returns true if the list changed
+    bool loadUsage(){
+        if (!usage){
+            return false;
+        }
+        bool finished = usage->done();
+        bool changed = applyUsage(usage->take());
+        if (finished){
+            FElog.add("disk usage done, " + std::to_string(usage->dirs()) +
+                " dirs");
+            usage.reset();
+        }
+        return changed || finished;
+    }
+
+    // stop the walk and keep the totals it has completed
+    void stopUsage(){
+        if (!usage){
+            return;
+        }
+        usage->cancel();
+        while (!usage->wait(REFRESH_INTERVAL));
+        loadUsage();
+    }
+
+    // entry name of the listing was added, removed or changed; its total
+    // and those above it are out of date, see forgetUsage
+    void usageChanged(const std::string& name){
+        usageForgotten.push_back(joinPath(listingPath, name) + '/');
+    }
+
+    // forget the totals of the entries changed since the last call
+    // a batch of changes restarts the walk once, below them only
+    void forgetUsage(){
+        if (!usageForgotten.size()){
+            return;
+        }
+        // the walk would put back what is forgotten
+        auto base = joinPath(usageFor, "");
+        if (usage && std::any_of(usageForgotten.begin(),
+            usageForgotten.end(),
+            [&](const std::string& dir){ return dir.starts_with(base); }))
+        {
+            stopUsage();
+        }
+        for (const auto& dir : usageForgotten){
+            usageCache.forget(dir);
+        }
+        usageForgotten.clear();
+        // walked again by the next poll()
+        if (!usage){
+            usageFor = "";
+        }
+    }
+
+    // queue every unclassified entry for libmagic in the background
+    void classifyAll(){
+        if (!USE_MAGIC){
+            return;
+        }
+        for (size_t i = 0; i < files.size(); i++){
+            if (!files.classified(i) && !files.removed(i)){
+                classifier.push(i, files.path(i), false);
+            }
+        }
+    }
+
+    // select entries [first, last) that were selected when their listing
+    // was left
+    void adoptSelections(size_t first, size_t last){
+        if (!selectedElsewhere.below(joinPath(getcwd(), ""))){
+            return;
+        }
+        for (size_t i = first; i < last; i++){
+            if (!files.removed(i) && selectedElsewhere.take(files.path(i))){
+                selection.set(i, files.fileSize(i), true);
+            }
+        }
+    }
+
+    // keep the selection of the listing that is left by path
+    void stashSelections(){
+        selection.forEach([&](size_t i){
+            selectedElsewhere.add(files.path(i), files.fileSize(i));
+        });
+        selection.clear();
+    }
+
+    // move the current directory listing into the cache
+    void saveListing(){
+        // its last totals still go to this listing
+        stopUsage();
+        stashSelections();
+        search.reset();
+        clearFilterStack();
+        // half loaded listings are not worth keeping
+        if (loader){
+            loader.reset();
+            watcher.unwatch();
+            listingPath = "";
+        }
+        if (listingPath == ""){
+            return;
+        }
+        if (watcher.watching()){
+            // stamp first: anything changed after this moves the stamp
+            // and invalidates the cached listing
+            struct stat dirstat;
+            if (fstat(watcher.dirfd(), &dirstat) == 0){
+                stamp = DirStamp::of(dirstat);
+                loaded = time(NULL);
+            }
+            applyChanges();
+            forgetUsage();
+            bool lost = watcher.isLost();
+            watcher.unwatch();
+            // changes were missed, the directory is read again next time
+            if (lost){
+                listingPath = "";
+                return;
+            }
+        }
+        Listing listing;
+        listing.path = listingPath;
+        listing.stamp = stamp;
+        listing.loaded = loaded;
+        listing.files = std::move(files);
+        listing.filterResult = std::move(filterResult);
+        listing.filter = filter;
+        listing.sortMethod = sortMethod;
+        listing.ranked = ranked;
+        listing.cur = cur;
+        listing.scroll = scroll;
+        listing.usage = usageMode;
+        cache.put(std::move(listing));
+        listingPath = "";
+    }
+
+    static File::Type kindOf(File::Type type){
+        return type == File::DIR || type == File::SYM ? type : File::UKN;
+    }
+
+    // apply what inotify reported since the last call
+    // only the changed names are lstat-ed and classified. A batch of
+    // changes is applied at once: removed and resized entries leave
+    // filterResult in one pass, new and resized ones are merged back in
+    // order, so a bulk rm or paste costs no more than listing it.
+    // If the watch is lost nothing is applied and watcher.isLost() is
+    // set until unwatch(); the caller reads the directory again.
+    // returns true if the listing changed
+    bool applyChanges(){
+        if (!watcher.watching()){
+            return false;
+        }
+        auto changes = watcher.readChanges();
+        if (watcher.isLost()){
+            FElog.add("lost track of " + listingPath);
+            return true;
+        }
+
+        // entries to take out of filterResult, and to merge into it
+        std::vector<size_t> dropped;
+        std::vector<size_t> added;
+        for (const auto& change : changes){
+            FElog.add("changed: " + change.name);
+            // listings have their directory at index 0
+            long i = files.find(0, change.name);
+            Stat st = statAt(watcher.dirfd(), change.name.c_str());
+            if (st.error && st.error != ENOENT){
+                continue;
+            }
+            if (usageMode){
+                usageChanged(change.name);
+                if (!st.error && !S_ISDIR(st.mode)){
+                    st.size = st.usage;
+                }
+            }
+            if (i != -1 &&
+                (st.error || kindOf(files.type(i)) != File::typeOf(st.mode)))
+            {
+                selection.set(i, files.fileSize(i), false);
+                files.remove(i);
+                dropped.push_back(i);
+                i = -1;
+            }
+            if (st.error){
+                continue;
+            }
+
+            if (i == -1){
+                i = files.add(0, change.name, st, watcher.dirfd());
+                if (query.match(files.displayName(i))){
+                    added.push_back(i);
+                }
+            }else{
+                // the total of a directory comes from the next walk
+                if (usageMode && S_ISDIR(st.mode)){
+                    st.size = files.fileSize(i);
+                }
+                if (files.fileSize(i) != st.size ||
+                    files.mtime(i) != nanoseconds(st.mtime))
+                {
+                    selection.resize(i, files.fileSize(i), st.size);
+                    files.setSize(i, st.size);
+                    files.setTime(i, st.mtime);
+                    sorter.changed();
+                    if (Sorter::byStat(sortMethod) &&
+                        query.match(files.displayName(i)))
+                    {
+                        dropped.push_back(i);
+                        added.push_back(i);
+                    }else{
+                        changedRows.push_back(i);
+                    }
+                }
+                if (!change.written){
+                    continue;
+                }
+                files.unclassify(i);
+                classifier.forget(i);
+            }
+            if (USE_MAGIC){
+                classifier.push(i, files.path(i), false);
+            }
+        }
+
+        long curFile = filterResult.size() ? filterResult[cur] : -1;
+        if (dropped.size()){
+            clearFilterStack();
+            listVersion++;
+            std::vector<bool> drop(files.size());
+            for (auto i : dropped){
+                drop[i] = true;
+            }
+            // the cursor keeps its place if its file is gone
+            long before = 0;
+            for (long r = 0; r < cur && r < (long)filterResult.size(); r++){
+                before += drop[filterResult[r]];
+            }
+            std::erase_if(filterResult, [&](size_t i){ return drop[i]; });
+            setCur(cur - before);
         }
+        mergeEntries(added);
+        keepCursorOn(curFile);
+        return dropped.size() || added.size() || changedRows.size();
+    }
+
+    void restoreListing(Listing&& listing){
+        FElog.add("restore cached listing: " + listing.path);
+        listingPath = listing.path;
+        stamp = listing.stamp;
+        loaded = listing.loaded;
+        files = std::move(listing.files);
+        sorter.clear();
+        filterResult = std::move(listing.filterResult);
+        listVersion++;
+        clearFilterStack();
+        setFilter(listing.filter);
+        sortMethod = Sorter::Order(listing.sortMethod);
+        ranked = listing.ranked;
+        cur = listing.cur;
+        scroll = listing.scroll;
+        setCur(cur);
+        classifier.reset();
+        visible.clear();
+        changedRows.clear();
+        adoptSelections(0, files.size());
+        classifyAll();
+    }
+    
+    void setFilter(const std::string& str){
+        filter = str;
+        query = Query(str);
+        ranked = false;
     }
     
     public:
@@ -126,33 +674,141 @@ class Explorer{
         }else{
             history.push_back(buf + "/"s);
             cd(".");
+            index.open(expandHome(INDEX_FILE));
         }
     }
     
     const std::string& getcwd(){
         return history.back();
     }
+
+    // path with ~ expanded, relative paths start at the current directory
+    std::string absolutePath(const std::string& path){
+        auto expanded = expandHome(path);
+        if (!expanded.starts_with("/")){
+            expanded = joinPath(getcwd(), expanded);
+        }
+        return expanded;
+    }
     
     void cd(const std::string& path, bool recur = false){
-        auto realPath = getRealPath(path);
+        int handle;
+        auto realPath = getRealPath(path, handle);
+        if (handle == -1){
+            return;
+        }
         FElog.add("change directory: " + realPath);
 
-        DIR* dir = opendir(realPath.c_str());
-        if (!dir) {
-            exitError("cd" + realPath);
+        auto next = std::make_unique<Loader>(handle);
+        close(handle);
+        if (!next->ok()) {
+            exitError("cd " + realPath);
             return;
         }
-        files.clear();
-        filterResult.clear();
-        
-        loadEntries(dir, realPath);
-        closedir(dir);
-        
-        sort();
-        cur = 0;
+        saveListing();
+        // watch before looking at the directory so no change is missed
+        watcher.watch(realPath);
+
+        struct stat dirstat;
+        if (fstat(next->getfd(), &dirstat) == -1){
+            exitError("cd " + realPath);
+            return;
+        }
+        auto newStamp = DirStamp::of(dirstat);
         if (history.size() == 0 || history.back() != realPath){
             history.push_back(realPath);
         }
+
+        // filter, sorting, cursor and scroll come back as they were left
+        if (cache.contains(realPath, newStamp, usageMode)){
+            restoreListing(cache.take(realPath));
+            return;
+        }
+
+        cache.erase(realPath);
+        files.clear(realPath);
+        sorter.clear();
+        files.addDir(realPath);
+        filterResult.clear();
+        listVersion++;
+        setFilter("");
+        classifier.reset();
+        visible.clear();
+        changedRows.clear();
+        listingPath = realPath;
+        stamp = newStamp;
+        loaded = time(NULL);
+        cur = 0;
+        scroll = 0;
+
+        // entries stream in from the loader thread, see poll()
+        // small directories are done before the first frame
+        loader = std::move(next);
+        loader->start();
+        loader->wait(REFRESH_INTERVAL);
+        loadEntries();
+    }
+    
+    // reread the current directory, skipping the cache
+    // in disk usage mode everything below is counted again
+    void refresh(){
+        if (usageMode){
+            stopUsage();
+            usageCache.forget(joinPath(getcwd(), ""));
+            usageFor = "";
+        }
+        reload();
+    }
+
+    // read the current directory again without the cached listing
+    void reload(){
+        listingPath = "";
+        watcher.unwatch();
+        cache.erase(getcwd());
+        cd(getcwd());
+    }
+
+    // show disk usage instead of sizes, or go back to sizes
+    // directory totals walked before stay cached either way
+    void toggleUsage(){
+        usageMode = !usageMode;
+        stopUsage();
+        usageFor = "";
+        // the listing holds sizes of the other kind
+        reload();
+    }
+
+    // total disk usage of the current directory in disk usage mode, or
+    // "" if not in disk usage mode
+    std::string diskUsage(){
+        if (!usageMode){
+            return "";
+        }
+        off_t total = usageCache.find(joinPath(getcwd(), ""));
+        if (total == -1){
+            return "counting disk usage...";
+        }
+        return fileSizeStr(total) + " on disk";
+    }
+
+    // progress of the running disk usage walk
+    std::string usageProgress(){
+        if (!usage){
+            return "";
+        }
+        return "disk usage: " + fileSizeStr(usage->bytes()) + " in " +
+            std::to_string(usage->dirs()) + " dirs";
+    }
+
+    // bring the listing up to date after changing the directory
+    void sync(){
+        if (watcher.watching()){
+            applyChanges();
+            forgetUsage();
+        }
+        if (!watcher.watching() || watcher.isLost()){
+            refresh();
+        }
     }
     
     void back(){
@@ -164,17 +820,27 @@ class Explorer{
     }
     
     void nextSort(){
-        sortMethod = Sort((sortMethod + 1) % ( NONE+1 ));
+        // an unfiltered list is the whole listing in order already, the
+        // next orders start from it instead of sorting all over
+        if (query.empty() && !ranked){
+            sorter.seed(files, sortMethod, filterResult);
+        }
+        sortMethod = Sorter::Order((sortMethod + 1) % (Sorter::NONE + 1));
         sort();
     }
     
-    std::string sortBy(){
+    std::string_view sortBy(){
         switch (sortMethod){
-            case NAME_A: return "Name ascending";
-            case NAME_D: return "Name decending";
-            case SIZE_A: return "Size ascending";
-            case SIZE_D: return "Size descending";
-            case NONE:   return "";
+            case Sorter::NAME_A:    return "Name ascending";
+            case Sorter::NAME_D:    return "Name decending";
+            case Sorter::NATURAL:   return "Version";
+            case Sorter::EXTENSION: return "Extension";
+            case Sorter::SIZE_A:    return "Size ascending";
+            case Sorter::SIZE_D:    return "Size descending";
+            case Sorter::TIME_D:    return "Newest first";
+            case Sorter::TIME_A:    return "Oldest first";
+            case Sorter::TYPE:      return "Directories first";
+            case Sorter::NONE:      return "";
         }
     }
     
@@ -182,48 +848,135 @@ class Explorer{
         return filterResult.size();
     }
     
-    std::vector<File> getFiles(){
-        std::vector<File> fs;
-        for (const auto& r : filterResult){
-            fs.push_back(files.at(r));
+    // the filtered and sorted list, read in place
+    // only valid until the listing next changes, i.e. for one frame
+    class View{
+        EntryTable& files;
+        std::span<const size_t> rows;
+        uint64_t listVersion;
+        std::span<const size_t> changedRows;
+        const Selection& selection;
+
+        public:
+        View(EntryTable& files, std::span<const size_t> rows,
+            uint64_t listVersion, std::span<const size_t> changedRows,
+            const Selection& selection):
+            files(files), rows(rows), listVersion(listVersion),
+            changedRows(changedRows), selection(selection) {}
+
+        size_t size() const {
+            return rows.size();
+        }
+
+        // see EntryTable::generation()
+        uint64_t generation() const {
+            return files.generation();
+        }
+
+        // changes whenever the rows or their order do
+        uint64_t version() const {
+            return listVersion;
+        }
+
+        // file indices whose row may look different since
+        // Explorer::forgetChangedRows() while the version stayed the same
+        std::span<const size_t> changed() const {
+            return changedRows;
+        }
+
+        EntryRef operator[](size_t row) const {
+            return EntryRef(files, rows[row]);
         }
-        return fs;
+
+        bool selected(size_t row) const {
+            return selection.contains(rows[row]);
+        }
+    };
+
+    View view(){
+        return View(files, filterResult, listVersion, changedRows,
+            selection);
     }
-    
-    bool& select(size_t index){
-        return files[filterResult[index]].selected;
+
+    // the changed rows of view() are accounted for
+    void forgetChangedRows(){
+        changedRows.clear();
     }
     
+    // toggle selection of the index-th file in the filtered list
+    void toggleSelect(size_t index){
+        toggleSelect(index, index + 1);
+    }
+
+    // toggle selections of files [begin, end) in the filtered list
+    void toggleSelect(size_t begin, size_t end){
+        end = std::min(end, filterResult.size());
+        for (size_t r = begin; r < end; r++){
+            size_t i = filterResult[r];
+            selection.toggle(i, files.fileSize(i));
+        }
+    }
+
+    // selected files here and in listings that were left
     std::vector<File> getSelected(){
         std::vector<File> selected;
-        for (const auto& f : files){
-            if (f.selected){
-                selected.push_back(f);
-            }
-        }
+        selection.forEach([&](size_t i){
+            selected.push_back(files.file(i));
+        });
+        selectedElsewhere.forEach([&](const std::string& path){
+            selected.push_back(File(path, ""));
+        });
         return selected;
     }
     
     std::vector<std::string> getSelectedPaths(){
-        std::vector<File> selected = getSelected();
         std::vector<std::string> paths;
-        for (auto& f : selected){
-            paths.push_back(f.fullpath);
-        }
+        selection.forEach([&](size_t i){
+            paths.push_back(files.path(i));
+        });
+        selectedElsewhere.forEach([&](const std::string& path){
+            paths.push_back(path);
+        });
         return paths;
     }
+
+    // remember the selected files, or the file under the cursor, to paste
+    // them later; returns how many
+    size_t yank(){
+        yanked = getSelectedPaths();
+        if (!yanked.size() && filterResult.size()){
+            yanked.push_back(files.path(filterResult[cur]));
+        }
+        return yanked.size();
+    }
+
+    const std::vector<std::string>& getYanked(){
+        return yanked;
+    }
+
+    size_t selectedCount(){
+        return selection.size() + selectedElsewhere.size();
+    }
+
+    // total size of the selected files
+    off_t selectedSize(){
+        return selection.totalSize() + selectedElsewhere.totalSize();
+    }
     
     void clearSelection(){
-        for (auto& f : files){
-            f.selected = false;
-        }
+        selection.clear();
+        selectedElsewhere.clear();
     }
     
     void clearFilter(){
+        setFilter("");
         filterResult.clear();
         for (size_t i = 0; i < files.size(); i++){
-            filterResult.push_back(i);
+            if (!files.removed(i)){
+                filterResult.push_back(i);
+            }
         }
+        sort();
     }
     
     void setCur(long pos){
@@ -244,66 +997,390 @@ class Explorer{
         return cur;
     }
     
+    size_t getScroll(){
+        return scroll;
+    }
+    
+    void setScroll(size_t scroll){
+        this->scroll = scroll;
+    }
+    
     File getCurFile(){
-        return files.at(filterResult.at(cur));
+        return files.file(filterResult.at(cur));
     }
     
+    // typing a longer query narrows the current result instead of
+    // scanning all files again, and earlier results are kept so that
+    // deleting characters goes straight back to them
     void filterName(const std::string& name){
         cur = 0;
         FElog.add("filtering: " + name);
+        bool flat = files.flat();
+
+        // back to a query typed before
+        while (filterStack.size() && filterStack.back().filter != name &&
+            filterStack.back().filter.length() >= name.length())
+        {
+            filterStackBytes -=
+                filterStack.back().result.size() * sizeof(size_t);
+            filterStack.pop_back();
+        }
+        if (filterStack.size() && filterStack.back().filter == name){
+            FElog.add("filter from stack");
+            setFilter(name);
+            filterStackBytes -=
+                filterStack.back().result.size() * sizeof(size_t);
+            filterResult = std::move(filterStack.back().result);
+            filterStack.pop_back();
+            listVersion++;
+            return;
+        }
+
+        Query next(name);
+        if (!next.valid()){
+            exitError("filter " + name, next.getError());
+        }
+        if (next.narrows(query)){
+            // every match of next matches the current query, and
+            // filtering keeps the sorted order
+            pushFilterState();
+            setFilter(name);
+            if (flat && filterResult.size() > files.size() / 8){
+                // still most of the listing, one pass over the arena is
+                // cheaper than testing each name on its own
+                std::vector<size_t> hits;
+                files.findName(query.text(), query.folded(), hits);
+                std::vector<bool> hit(files.size());
+                for (auto i : hits){
+                    hit[i] = true;
+                }
+                std::erase_if(filterResult, [&](size_t i){
+                    return !hit[i];
+                });
+            }else{
+                std::erase_if(filterResult, [&](size_t i){
+                    return !query.match(flat ? files.name(i) :
+                        std::string_view(files.displayName(i)));
+                });
+            }
+            listVersion++;
+            FElog.add("narrowed " + std::to_string(filterResult.size()));
+            return;
+        }
+
+        setFilter(name);
         filterResult.clear();
-        size_t fno = 0;
-        for (int i = 0; i < files.size(); i++){
-            if (matchName(files[i].name, name)){
-                filterResult.push_back(i);
-                fno++;
+        // names of a directory listing are their display names, literal
+        // queries can scan the name arena directly
+        if (flat && query.isLiteral() && !query.empty()){
+            files.findName(query.text(), query.folded(), filterResult);
+        }else if (query.getType() == Query::FUZZY){
+            // names missing any character of the query are dropped on
+            // their precomputed mask, rank() scores the rest
+            uint64_t needs = query.needs();
+            for (size_t i = 0; i < files.size(); i++){
+                if (!files.removed(i) && (files.charMask(i) & needs) == needs){
+                    filterResult.push_back(i);
+                }
+            }
+        }else{
+            for (size_t i = 0; i < files.size(); i++){
+                if (!files.removed(i) && query.match(
+                    flat ? files.name(i) : files.displayName(i)))
+                {
+                    filterResult.push_back(i);
+                }
             }
         }
-        FElog.add("filtered " + std::to_string(fno));
+        if (query.getType() == Query::FUZZY){
+            rank();
+        }else{
+            sort();
+        }
+        FElog.add("filtered " + std::to_string(filterResult.size()));
     }
     
+    // scan the part of the index below dir d instead of walking the tree
+    // results are as fresh as the last :index
+    void searchIndex(uint32_t d, const Query& match){
+        FElog.add("search index from " + index.dirPath(d));
+        // table dir of the index dir last matched in
+        uint32_t lastDir = FileIndex::NONE;
+        size_t tableDir = 0;
+        size_t first = files.size();
+        index.scan(d, [&](size_t dir, size_t e){
+            const auto& entry = index.entry(e);
+            const char* entryName = index.name(entry.name);
+            if (!match.match(entryName)){
+                return;
+            }
+            if (dir != lastDir){
+                lastDir = dir;
+                tableDir = files.addDir(index.dirPath(dir));
+            }
+            Stat st;
+            st.mode = entry.mode;
+            st.size = entry.size;
+            st.mtime = { (time_t)entry.mtime[0], (long)entry.mtime[1] };
+            size_t i = files.add(tableDir, entryName, st, -1);
+            if (files.type(i) == File::SYM){
+                files.setSym(i, File::resolveSymLink(
+                    AT_FDCWD, files.path(i).c_str()));
+            }
+            filterResult.push_back(i);
+        });
+        adoptSelections(first, files.size());
+        if (ranked){
+            rank();
+        }else{
+            sort();
+        }
+    }
+
+    // matches stream in from the walk, see poll()
     void searchRecur(const std::string& name){
-        files.clear();
+        auto basepath = getcwd();
+        // keep the listing so leaving the search is instant
+        saveListing();
+        watcher.unwatch();
+        files.clear(basepath);
+        sorter.clear();
+        setFilter("");
+        cur = 0;
+        scroll = 0;
         filterResult.clear();
+        listVersion++;
+        classifier.reset();
+        visible.clear();
+        changedRows.clear();
 
-        auto basepath = getcwd();
-        std::deque<File> dirs;
-        dirs.push_back(File("", basepath, false));
+        Query match(name);
+        if (!match.valid()){
+            exitError("search " + name, match.getError());
+            return;
+        }
+        // fuzzy matches are ranked by their relative path as they come in
+        if (match.getType() == Query::FUZZY){
+            setFilter(name);
+            ranked = true;
+        }
+        uint32_t indexed = index.find(basepath);
+        if (indexed != FileIndex::NONE){
+            searchIndex(indexed, match);
+            return;
+        }
 
-        while(dirs.size()){
-            File f = dirs[0];
-            dirs.pop_front();
+        search = std::make_unique<TreeWalk>(
+            AT_FDCWD, basepath.c_str(), match);
+        if (!search->ok()){
+            exitError(basepath);
+            search.reset();
+            return;
+        }
+        searchBase = basepath;
+        search->start();
+        search->wait(REFRESH_INTERVAL);
+        loadMatches();
+    }
+    
+    // classify rows [begin, end) of the filtered list ahead of the rest
+    // search results are only classified once they are shown
+    void classifyVisible(size_t begin, size_t end){
+        if (!USE_MAGIC){
+            return;
+        }
+        visible.clear();
+        for (size_t i = begin; i < end && i < filterResult.size(); i++){
+            size_t index = filterResult[i];
+            visible.push_back(index);
+            if (!files.classified(index)){
+                classifier.push(index, files.path(index), true);
+            }
+        }
+    }
 
-            if (f.type != File::DIR){
-                continue;
+    // apply finished background work
+    // returns true if anything on screen changed
+    bool poll(){
+        bool changed = loadEntries() | loadMatches();
+        if (indexer && indexer->done()){
+            if (indexer->getError() != ""){
+                exitError("index", indexer->getError());
+            }else{
+                FElog.add("indexed " + std::to_string(indexer->indexed()));
+                index.open(expandHome(INDEX_FILE));
             }
-            DIR* d = opendir(f.fullpath.c_str());
-            struct dirent* dirent;
-            while((dirent = readdir(d))){
-                File entry(dirent->d_name, f.fullpath, basepath, false);
-                if (entry.fullpath.ends_with("/.") ||
-                    entry.fullpath.ends_with("/.."))
-                {
-                    continue;
-                }
+            indexer.reset();
+            changed = true;
+        }
+        // inotify events wait in the kernel until loading is done,
+        // names the loader has not reached yet would be added twice
+        if (!loader){
+            changed |= applyChanges();
+            forgetUsage();
+            if (watcher.isLost()){
+                refresh();
+            }
+        }
+        for (auto& r : classifier.take()){
+            files.setMagic(r.index, r.magic);
+            changedRows.push_back(r.index);
+            changed |= std::find(visible.begin(), visible.end(), r.index) !=
+                visible.end();
+        }
+        changed |= loadUsage();
+        // disk usage is walked once the listing is complete
+        if (usageMode && !loader && listingPath != "" &&
+            usageFor != listingPath)
+        {
+            startUsage();
+            changed = true;
+        }
+        auto finished = jobs.take();
+        for (const auto& [name, errors] : finished){
+            FElog.add(name + " done");
+            reportErrors(name, errors);
+        }
+        // a watched listing has followed the job entry by entry already
+        if (finished.size() && !watcher.watching() && listingPath != ""){
+            refresh();
+        }
+        // progress of running jobs and walks changes all the time
+        return changed || finished.size() || jobs.size() || usage;
+    }
 
-                // if match
-                // only match file name
-                auto filename = std::string(
-                    entry.name.begin() + entry.name.find_last_of('/'),
-                    entry.name.end());
-                if (matchName(filename, name)){
-                    files.push_back(entry);
-                    filterResult.push_back(files.size()-1);
-                }
+    // background work is still running for this listing
+    bool busy(){
+        return loader || search || indexer || classifier.busy() ||
+            jobs.size() || usage;
+    }
 
-                // if directory
-                if (entry.type == File::DIR){
-                    dirs.push_back(entry);
-                }
+    // run work in the background as a job called name, see Jobs
+    void runJob(const std::string& name, Job::Work work){
+        size_t id = jobs.add(name, std::move(work));
+        FElog.add("job " + std::to_string(id) + ": " + name);
+    }
+
+    // cancel job id, or all jobs if id is 0
+    void cancelJob(size_t id){
+        if (!id){
+            jobs.cancelAll();
+        }else if (!jobs.cancel(id)){
+            exitError("cancel", "no job " + std::to_string(id));
+        }
+    }
+
+    // list every job in the footer, or only the oldest
+    void toggleJobs(){
+        showJobs = !showJobs;
+    }
+
+    // footer lines of the running and waiting jobs
+    std::vector<std::string> jobsStatus(){
+        std::vector<std::string> lines;
+        jobs.forEach([&](const Job& job){
+            if (showJobs || !lines.size()){
+                lines.push_back(job.status());
+            }
+        });
+        if (!showJobs && jobs.size() > 1){
+            lines.back() += "  (+" + std::to_string(jobs.size() - 1) +
+                " jobs, :jobs)";
+        }
+        return lines;
+    }
+
+    // directory is still being read
+    bool loading(){
+        return (bool)loader;
+    }
+
+    // entries read so far while loading
+    size_t loadingCount(){
+        return loader ? loader->loaded() : files.size();
+    }
+
+    // stop loading and keep the entries read so far
+    void cancelLoad(){
+        if (!loader){
+            return;
+        }
+        FElog.add("cancel loading " + listingPath);
+        loader->cancel();
+        while (loader){
+            loader->wait(REFRESH_INTERVAL);
+            loadEntries();
+        }
+        // incomplete, neither cached nor updated
+        watcher.unwatch();
+        listingPath = "";
+    }
+
+    // recursive search is still walking the tree
+    bool searching(){
+        return (bool)search;
+    }
+
+    // progress of the running search
+    std::string searchProgress(){
+        if (!search){
+            return "";
+        }
+        return "scanned " + std::to_string(search->dirs()) + " dirs / " +
+            std::to_string(search->entries()) + " entries, " +
+            std::to_string(search->matches()) + " matches";
+    }
+
+    // index path for recursive search, or refresh all indexed trees if
+    // path is empty; directories unchanged since the last run are not read
+    void buildIndex(const std::string& path){
+        if (indexer){
+            exitError("index", "already running");
+            return;
+        }
+        auto roots = index.roots();
+        if (path != "" || !roots.size()){
+            int handle;
+            auto root = getRealPath(path != "" ? path : getcwd(), handle);
+            if (handle == -1){
+                return;
             }
+            close(handle);
+            root = joinPath(root, "");
+            if (std::find(roots.begin(), roots.end(), root) == roots.end()){
+                roots.push_back(root);
+            }
+        }
+        indexer = std::make_unique<IndexBuilder>(
+            expandHome(INDEX_FILE), roots);
+        indexer->start();
+    }
+
+    std::string indexProgress(){
+        if (!indexer){
+            return "";
+        }
+        return "indexing " + std::to_string(indexer->indexed()) +
+            " dirs, " + std::to_string(indexer->reread()) + " changed";
+    }
+
+    // stop searching and keep the matches found so far
+    void cancelSearch(){
+        if (!search){
+            return;
+        }
+        FElog.add("cancel search in " + searchBase);
+        search->cancel();
+        while (search){
+            search->wait(REFRESH_INTERVAL);
+            loadMatches();
         }
     }
+
+    // fd that becomes readable when the listed directory changes, or -1
+    int watchFd(){
+        return watcher.getfd();
+    }
     
     std::string getHomeDir(){
         return getenv("HOME");
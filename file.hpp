@@ -3,6 +3,8 @@
 
 #include "config.hpp"
 #include "log.hpp"
+#include "statx.hpp"
+#include "classify.hpp"
 
 using namespace std::string_literals;
 
@@ -10,29 +12,13 @@ static magic_t magicCookie;
 
 static inline void magicInit(){
     FElog.add("Initialize libmagic");
-    magicCookie = magic_open(
-        MAGIC_NO_CHECK_APPTYPE | MAGIC_NO_CHECK_COMPRESS |
-        MAGIC_NO_CHECK_ELF | MAGIC_NO_CHECK_ENCODING |
-        MAGIC_NO_CHECK_TOKENS );
-    if (magicCookie == NULL) {
-        exitError(
-            "Explorer",
-            "unable to initialize magic library");
-        return;
-    }
-    
-    FElog.add("Loading default magic database");
-    if (magic_load(magicCookie, NULL) != 0) {
-        exitError(
-            "cannot load magic database",
-            magic_error(magicCookie));
-        magic_close(magicCookie);
-        return;
-    }
+    magicCookie = magicOpen();
 }
 
 static inline void magicEnd(){
-    magic_close(magicCookie);
+    if (magicCookie){
+        magic_close(magicCookie);
+    }
 }
 
 static inline std::string escapePath(const std::string& path){
@@ -46,10 +32,34 @@ static inline std::string escapePath(const std::string& path){
     return escaped;
 }
 
+static inline std::string
+joinPath(const std::string& dir, const std::string& name){
+    if (dir.length() && dir.back() != '/'){
+        return dir + '/' + name;
+    }
+    return dir + name;
+}
+
+// change from bytes to KB / MB / GB / TB
+static inline std::string fileSizeStr(off_t bytes){
+    float size = bytes;
+    static const char* const units[] = {
+        "B", "KB", "MB", "GB", "TB"
+    };
+
+    // log2 of 0 is not a number, and past TB stays in TB
+    size_t i = size >= 1 ? std::min<double>(log2(size)/10, 4) : 0;
+    char buf[100];
+    sprintf(buf, "%.1f %s", size/(pow(1024, i)), units[i]);
+    return buf;
+}
+
 static inline void runShell(std::string command){
     FElog.add("run shell: " + command);
     def_prog_mode();
     auto val = system(command.c_str());
+    // the command drew over the screen, repaint all of it
+    clearok(curscr, TRUE);
     refresh();
     
     if (val == -1){
@@ -65,78 +75,59 @@ static inline void runShell(std::string command){
 struct File{
     std::string fullpath = "";
     std::string name = "";
-    bool selected = false;
     enum Type {
         DIR, EXE, REG, SYM, UKN
     }type = REG;
     std::string sym = "";
     off_t size = 0;
     std::string magic;
+    // libmagic has not looked at this file yet
+    // regular files stay UKN until then
+    bool classified = false;
 
+    // fill in type and size from a finished lstat
+    // libmagic is not consulted here, see classify()
     File(const std::string& name,
         const std::string& parentDir,
-        bool useMagic = true):
+        const Stat& filestat):
             name(name)
     {
-        fullpath = parentDir;
-        if (parentDir.back() != '/') {
-            fullpath += '/';
+        fullpath = joinPath(parentDir, name);
+        if (filestat.error){
+            exitError(fullpath, strerror(filestat.error));
         }
-        fullpath += name;
 
-        FElog.add("checking file status with lstat: " + fullpath);
-        struct stat filestat;
-        if (lstat(fullpath.c_str(), &filestat) == -1){
-            exitError(fullpath);
+        size = filestat.size;
+        type = typeOf(filestat.mode);
+        if (type == SYM){
+            sym = resolveSymLink(AT_FDCWD, fullpath.c_str());
         }
-
-        size = filestat.st_size;
-
-        if (useMagic){
-            magic = magic_file(magicCookie, fullpath.c_str());
-            FElog.add("Magic of " + fullpath + ": " + magic);
-
-            if (S_ISDIR(filestat.st_mode)){
-                type = DIR;
-            }else if (S_ISLNK(filestat.st_mode)) {
-                type = SYM;
-                sym = resolveSymLink(fullpath);
-            }else if (isText()){
-                type = REG;
-            }else if (isExecutable()){
-                type = EXE;
-            }else {
-                type = UKN;
-            }
-        }else{
-            if (S_ISDIR(filestat.st_mode)){
-                type = DIR;
-            }else if (S_ISLNK(filestat.st_mode)){
-                type = SYM;
-                sym = resolveSymLink(fullpath);
-            }else{
-                type = UKN;
-            }
-        }
-        
     };
-    
+
+    File() = default;
+
     File(const std::string& name,
-        const std::string& parentdir,
-        const std::string& basepath,
-        bool useMagic = true) :
+        const std::string& parentDir):
     File(
-        [&](){
-            auto realpath = parentdir.ends_with('/') ?
-                parentdir + name :
-                parentdir + '/' + name;
-            return std::string(
-                realpath.begin() + basepath.length() + 1,
-                realpath.end()
-            );
-        }(),
-        basepath,
-        useMagic) { }
+        name,
+        parentDir,
+        statAt(AT_FDCWD, joinPath(parentDir, name).c_str())) { }
+
+    // store libmagic result and refine type of regular files
+    void setMagic(const std::string& description){
+        magic = description;
+        classified = true;
+        FElog.add("Magic of " + fullpath + ": " + magic);
+
+        type = typeOf(type, magic);
+    }
+
+    // classify now on the calling thread if no worker got to it yet
+    void classify(){
+        if (USE_MAGIC && !classified){
+            setMagic(magicDescribe(magicCookie, fullpath));
+        }
+    }
     
     bool hasEnding (const std::string& fullString, const std::string& ending) {
         if (fullString.length() >= ending.length()) {
@@ -148,6 +139,7 @@ struct File{
     }
     
     std::string open(){
+        classify();
         switch (type){
             case DIR:
             return fullpath;
@@ -190,26 +182,38 @@ struct File{
     }
     
     const std::string& getDescription(){
+        classify();
         return magic;
     }
     
-    private:
-    bool isText(){
-        return isType("text") || isType("JSON") || isType("CSV");
-    }
-    
-    bool isExecutable(){
-        return isType("executable");
+    // type known from lstat alone
+    // regular files are UKN until libmagic looks at them
+    static Type typeOf(mode_t mode){
+        if (S_ISDIR(mode)){
+            return DIR;
+        }else if (S_ISLNK(mode)){
+            return SYM;
+        }
+        return UKN;
     }
 
-    bool isType(const std::string& type){
-        return magic.find(type) != std::string::npos;
+    // refine type of a regular file with its libmagic description
+    static Type typeOf(Type type, const std::string& magic){
+        if (type == DIR || type == SYM){
+            return type;
+        }
+        if (isText(magic)){
+            return REG;
+        }else if (isExecutable(magic)){
+            return EXE;
+        }
+        return UKN;
     }
 
-    std::string resolveSymLink(const std::string& name){
+    static std::string resolveSymLink(int dirfd, const char* name){
         ssize_t length = 0;
         char buf[PATH_MAX];
-        length = readlink(name.c_str(), buf, PATH_MAX);
+        length = readlinkat(dirfd, name, buf, PATH_MAX - 1);
         if (length == -1){
             exitError(name);
             return "";
@@ -217,5 +221,20 @@ struct File{
         buf[length] = 0;
         return buf;
     }
+
+    private:
+    static bool isText(const std::string& magic){
+        return isType(magic, "text") ||
+            isType(magic, "JSON") ||
+            isType(magic, "CSV");
+    }
+    
+    static bool isExecutable(const std::string& magic){
+        return isType(magic, "executable");
+    }
+
+    static bool isType(const std::string& magic, const std::string& type){
+        return magic.find(type) != std::string::npos;
+    }
 };
 #endif
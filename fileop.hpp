@@ -0,0 +1,566 @@
+#ifndef _FILEOP_HPP_
+#define _FILEOP_HPP_
+
+#include "file.hpp"
+#include "pool.hpp"
+
+// a file an operation failed on and why
+struct OpError{
+    std::string path;
+    std::string error;
+};
+
+// counters of a running operation, read from other threads
+// totals grow as the operation finds out what it has to do
+struct OpProgress{
+    std::atomic<size_t> files = 0;
+    std::atomic<size_t> totalFiles = 0;
+    std::atomic<off_t> bytes = 0;
+    std::atomic<off_t> totalBytes = 0;
+    // stop soon, files done so far stay
+    std::atomic<bool> cancelled = false;
+};
+
+// last component of path, a trailing '/' is ignored
+static inline std::string baseName(std::string path){
+    while (path.length() > 1 && path.back() == '/'){
+        path.pop_back();
+    }
+    return path.substr(path.rfind('/') + 1);
+}
+
+// everything but the last component of path
+static inline std::string dirName(std::string path){
+    while (path.length() > 1 && path.back() == '/'){
+        path.pop_back();
+    }
+    auto slash = path.rfind('/');
+    if (slash == std::string::npos){
+        return ".";
+    }
+    return slash ? path.substr(0, slash) : "/";
+}
+
+// copy length bytes at offset of in to the same offset of out, or up to
+// the end of in if length is -1; returns an errno or 0, ECANCELED if the
+// operation was cancelled in between
+// copy_file_range lets the kernel copy without going through this
+// process; where it cannot (across some filesystems, or not on Linux)
+// the data is read and written
+static inline int copyRange(int in, int out, off_t offset, off_t length,
+    OpProgress& progress)
+{
+    // bytes between progress updates
+    const size_t CHUNK = 1 << 26;
+    bool toEnd = length < 0;
+    off_t end = offset + length;
+#ifdef __linux__
+    off_t inOffset = offset, outOffset = offset;
+    while (toEnd || inOffset < end){
+        if (progress.cancelled){
+            return ECANCELED;
+        }
+        size_t chunk = toEnd ? CHUNK : std::min<off_t>(end - inOffset, CHUNK);
+        ssize_t n = copy_file_range(in, &inOffset, out, &outOffset, chunk,
+            0);
+        if (n == 0){
+            return 0;
+        }
+        if (n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                errno == EOPNOTSUPP)
+            {
+                break;
+            }
+            return errno;
+        }
+        progress.bytes += n;
+    }
+    if (!toEnd && inOffset >= end){
+        return 0;
+    }
+    offset = inOffset;
+#endif
+    std::vector<char> buf(1 << 17);
+    while (toEnd || offset < end){
+        if (progress.cancelled){
+            return ECANCELED;
+        }
+        size_t chunk = toEnd ? buf.size() :
+            std::min<off_t>(end - offset, buf.size());
+        ssize_t n = pread(in, buf.data(), chunk, offset);
+        if (n == 0){
+            return 0;
+        }
+        if (n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            return errno;
+        }
+        for (ssize_t written = 0; written < n;){
+            ssize_t w = pwrite(out, buf.data() + written, n - written,
+                offset + written);
+            if (w == -1){
+                if (errno == EINTR){
+                    continue;
+                }
+                return errno;
+            }
+            written += w;
+        }
+        offset += n;
+        progress.bytes += n;
+    }
+    return 0;
+}
+
+// copy the data of in, described by st, to the empty file out
+// returns an errno or 0
+static inline int copyData(int in, int out, const struct stat& st,
+    OpProgress& progress)
+{
+#ifdef FICLONE
+    // btrfs and xfs share the blocks instead of copying them
+    if (ioctl(out, FICLONE, in) == 0){
+        progress.bytes += st.st_size;
+        return 0;
+    }
+#endif
+#ifdef SEEK_DATA
+    // fewer blocks than bytes: the file has holes, copy only its data so
+    // the copy keeps them
+    if ((off_t)st.st_blocks * 512 < st.st_size){
+        off_t data = 0;
+        off_t copied = 0;
+        while ((data = lseek(in, data, SEEK_DATA)) != -1){
+            off_t hole = lseek(in, data, SEEK_HOLE);
+            if (hole == -1){
+                return errno;
+            }
+            int error = copyRange(in, out, data, hole - data, progress);
+            if (error){
+                return error;
+            }
+            copied += hole - data;
+            data = hole;
+        }
+        if (errno != ENXIO){
+            return errno;
+        }
+        // holes are done as well
+        progress.bytes += st.st_size - copied;
+        return ftruncate(out, st.st_size) == -1 ? errno : 0;
+    }
+#endif
+    return copyRange(in, out, 0, -1, progress);
+}
+
+// copy the regular file from, described by st, to to with its mode and
+// times; returns an errno or 0
+// a copy cut short by cancelling is removed
+static inline int copyFile(const std::string& from, const std::string& to,
+    const struct stat& st, OpProgress& progress)
+{
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in == -1){
+        return errno;
+    }
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+        st.st_mode & 07777);
+    if (out == -1){
+        int error = errno;
+        close(in);
+        return error;
+    }
+    int error = copyData(in, out, st, progress);
+    close(in);
+    if (!error){
+#ifdef __APPLE__
+        struct timespec times[2] = { st.st_atimespec, st.st_mtimespec };
+#else
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+#endif
+        fchmod(out, st.st_mode & 07777);
+        futimens(out, times);
+    }
+    if (close(out) == -1 && !error){
+        error = errno;
+    }
+    if (error == ECANCELED){
+        unlink(to.c_str());
+    }
+    return error;
+}
+
+// threads regular files are copied on
+// apart from the shared pool: copying a file can take minutes, sorting
+// and classifying on the shared pool must not wait behind it
+static inline ThreadPool& copiers(){
+    static ThreadPool pool(COPY_IN_FLIGHT);
+    return pool;
+}
+
+// copies files and directory trees with their modes and times
+// the calling thread walks the trees, creates directories and links;
+// regular files are copied on copiers(), COPY_IN_FLIGHT at a time, so a
+// large tree is copied by several threads without opening all of its
+// files at once. The calling thread must not be one of the copiers.
+// Once cancelled, files not copied yet are skipped without an error.
+class TreeCopy{
+    OpProgress& progress;
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t inFlight = 0;
+    std::vector<OpError> errors;
+    // items with a file that failed
+    std::vector<bool> failed;
+    // directories made, their modes and times are set once all their
+    // entries are in
+    std::vector<std::pair<std::string, struct stat>> dirs;
+
+    void fail(size_t item, const std::string& path, int error){
+        std::lock_guard lock(mutex);
+        errors.push_back({ path, strerror(error) });
+        failed[item] = true;
+    }
+
+    void copyLater(size_t item, const std::string& from,
+        const std::string& to, const struct stat& st)
+    {
+        {
+            std::unique_lock lock(mutex);
+            cv.wait(lock, [&](){ return inFlight < COPY_IN_FLIGHT; });
+            inFlight++;
+        }
+        copiers().submit([=, this](){
+            int error = progress.cancelled ? ECANCELED :
+                copyFile(from, to, st, progress);
+            std::lock_guard lock(mutex);
+            if (error){
+                if (error != ECANCELED){
+                    errors.push_back({ from, strerror(error) });
+                }
+                failed[item] = true;
+            }else{
+                progress.files++;
+            }
+            inFlight--;
+            cv.notify_all();
+        });
+    }
+
+    // add the files of from and their sizes to the totals
+    void measure(const std::string& from){
+        struct stat st;
+        if (progress.cancelled || lstat(from.c_str(), &st) == -1){
+            return;
+        }
+        progress.totalFiles++;
+        if (S_ISREG(st.st_mode)){
+            progress.totalBytes += st.st_size;
+        }
+        if (!S_ISDIR(st.st_mode)){
+            return;
+        }
+        DIR* dir = opendir(from.c_str());
+        if (!dir){
+            return;
+        }
+        while (auto entry = readdir(dir)){
+            if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")){
+                measure(joinPath(from, entry->d_name));
+            }
+        }
+        closedir(dir);
+    }
+
+    void copy(size_t item, const std::string& from, const std::string& to){
+        if (progress.cancelled){
+            // copies on the pool write other bits of the same words
+            std::lock_guard lock(mutex);
+            failed[item] = true;
+            return;
+        }
+        struct stat st;
+        if (lstat(from.c_str(), &st) == -1){
+            return fail(item, from, errno);
+        }
+        switch (st.st_mode & S_IFMT){
+            case S_IFDIR: {
+                // writable until its entries are in
+                if (mkdir(to.c_str(), 0700) == -1 && errno != EEXIST){
+                    return fail(item, from, errno);
+                }
+                DIR* dir = opendir(from.c_str());
+                if (!dir){
+                    return fail(item, from, errno);
+                }
+                while (auto entry = readdir(dir)){
+                    if (!strcmp(entry->d_name, ".") ||
+                        !strcmp(entry->d_name, ".."))
+                    {
+                        continue;
+                    }
+                    copy(item, joinPath(from, entry->d_name),
+                        joinPath(to, entry->d_name));
+                }
+                closedir(dir);
+                dirs.push_back({ to, st });
+                progress.files++;
+                break;
+            }
+            case S_IFREG:
+                copyLater(item, from, to, st);
+                break;
+            case S_IFLNK: {
+                std::vector<char> target(st.st_size + 1);
+                ssize_t length = readlink(from.c_str(), target.data(),
+                    target.size());
+                if (length == -1){
+                    return fail(item, from, errno);
+                }
+                target.resize(length);
+                target.push_back(0);
+                if (symlink(target.data(), to.c_str()) == -1){
+                    return fail(item, from, errno);
+                }
+                progress.files++;
+                break;
+            }
+            default:
+                // fifos, sockets and devices
+                if (mknod(to.c_str(), st.st_mode, st.st_rdev) == -1){
+                    return fail(item, from, errno);
+                }
+                progress.files++;
+        }
+    }
+
+    public:
+    TreeCopy(OpProgress& progress): progress(progress) {}
+
+    // copy from[k] to to[k] for every k
+    // returns the files that could not be copied
+    std::vector<OpError> run(const std::vector<std::string>& from,
+        const std::vector<std::string>& to)
+    {
+        failed.assign(from.size(), false);
+        // the trees are walked twice, the second time from the cache, so
+        // that the totals are known before copying
+        for (const auto& path : from){
+            measure(path);
+        }
+        for (size_t k = 0; k < from.size(); k++){
+            copy(k, from[k], to[k]);
+        }
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&](){ return inFlight == 0; });
+        // deepest first, setting times of a directory is the last change
+        // to it
+        for (auto it = dirs.rbegin(); it != dirs.rend(); it++){
+            const auto& [path, st] = *it;
+#ifdef __APPLE__
+            struct timespec times[2] = { st.st_atimespec, st.st_mtimespec };
+#else
+            struct timespec times[2] = { st.st_atim, st.st_mtim };
+#endif
+            chmod(path.c_str(), st.st_mode & 07777);
+            utimensat(AT_FDCWD, path.c_str(), times, 0);
+        }
+        return std::move(errors);
+    }
+
+    // every file of from[item] was copied
+    bool copied(size_t item){
+        return !failed[item];
+    }
+};
+
+// remove name in dir, directories with everything in them
+// returns true if everything was removed
+static inline bool removeAt(int dir, const char* name,
+    const std::string& path, std::vector<OpError>& errors)
+{
+    if (unlinkat(dir, name, 0) == 0){
+        return true;
+    }
+    if (errno != EISDIR && errno != EPERM){
+        errors.push_back({ path, strerror(errno) });
+        return false;
+    }
+    int fd = openat(dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+        O_CLOEXEC);
+    DIR* entries = fd == -1 ? NULL : fdopendir(fd);
+    if (!entries){
+        errors.push_back({ path, strerror(errno) });
+        if (fd != -1){
+            close(fd);
+        }
+        return false;
+    }
+    bool ok = true;
+    while (auto entry = readdir(entries)){
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")){
+            continue;
+        }
+        ok &= removeAt(dirfd(entries), entry->d_name,
+            joinPath(path, entry->d_name), errors);
+    }
+    closedir(entries);
+    if (ok && unlinkat(dir, name, AT_REMOVEDIR) == -1){
+        errors.push_back({ path, strerror(errno) });
+        return false;
+    }
+    return ok;
+}
+
+// move files like mv(1): into to if it is a directory, else a single
+// file is renamed to it. Files are renamed where they are; moves to
+// another filesystem are copied and the original removed once the copy
+// is complete. Consecutive files of one directory share its handle, so
+// a selection of a listing walks no path twice.
+// the calling thread must not be one of the copiers, see TreeCopy
+// returns the files that could not be moved
+static inline std::vector<OpError> moveFiles(
+    const std::vector<std::string>& from, const std::string& to,
+    OpProgress& progress)
+{
+    std::vector<OpError> errors;
+    struct stat st;
+    bool intoDir = stat(to.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    if (!intoDir && from.size() > 1){
+        errors.push_back({ to, strerror(ENOTDIR) });
+        return errors;
+    }
+    std::string toPath = intoDir ? to : dirName(to);
+    int toDir = open(toPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (toDir == -1){
+        errors.push_back({ toPath, strerror(errno) });
+        return errors;
+    }
+    int fromDir = -1;
+    std::string fromPath;
+    // files to copy to the other filesystem
+    std::vector<std::string> copyFrom, copyTo;
+    progress.totalFiles += from.size();
+    for (const auto& path : from){
+        if (progress.cancelled){
+            break;
+        }
+        auto parent = dirName(path);
+        if (fromDir == -1 || parent != fromPath){
+            if (fromDir != -1){
+                close(fromDir);
+            }
+            fromPath = parent;
+            fromDir = open(parent.c_str(),
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fromDir == -1){
+                errors.push_back({ path, strerror(errno) });
+                continue;
+            }
+        }
+        auto name = baseName(path);
+        auto target = intoDir ? name : baseName(to);
+        if (renameat(fromDir, name.c_str(), toDir, target.c_str()) == 0){
+            progress.files++;
+            continue;
+        }
+        if (errno != EXDEV){
+            errors.push_back({ path, strerror(errno) });
+            continue;
+        }
+        FElog.add("move across filesystems: " + path);
+        // counted again with everything in it
+        progress.totalFiles--;
+        copyFrom.push_back(path);
+        copyTo.push_back(joinPath(toPath, target));
+    }
+    if (fromDir != -1){
+        close(fromDir);
+    }
+    close(toDir);
+    if (copyFrom.size()){
+        TreeCopy copy(progress);
+        auto failed = copy.run(copyFrom, copyTo);
+        errors.insert(errors.end(), failed.begin(), failed.end());
+        for (size_t k = 0; k < copyFrom.size(); k++){
+            if (copy.copied(k)){
+                removeAt(AT_FDCWD, copyFrom[k].c_str(), copyFrom[k], errors);
+            }
+        }
+    }
+    return errors;
+}
+
+// files to paste from into the directory to, paired with where they go
+// a name that is taken gets a number, "name_1.ext", "name_2.ext" and so
+// on, so pasting next to the original keeps it
+static inline std::vector<std::string> pasteTargets(
+    const std::vector<std::string>& from, const std::string& to)
+{
+    std::vector<std::string> targets;
+    std::unordered_set<std::string> taken;
+    for (const auto& path : from){
+        auto name = baseName(path);
+        auto dot = name.rfind('.');
+        if (dot == 0 || dot == std::string::npos){
+            dot = name.length();
+        }
+        auto target = joinPath(to, name);
+        struct stat st;
+        for (size_t n = 1; taken.contains(target) ||
+            lstat(target.c_str(), &st) == 0; n++)
+        {
+            target = joinPath(to, name.substr(0, dot) + "_" +
+                std::to_string(n) + name.substr(dot));
+        }
+        taken.insert(target);
+        targets.push_back(target);
+    }
+    return targets;
+}
+
+// copy files into the directory to, see pasteTargets()
+// the calling thread must not be one of the copiers, see TreeCopy
+static inline std::vector<OpError> copyFiles(
+    const std::vector<std::string>& from, const std::string& to,
+    OpProgress& progress)
+{
+    auto targets = pasteTargets(from, to);
+    std::vector<OpError> errors;
+    std::vector<std::string> copyFrom, copyTo;
+    for (size_t k = 0; k < from.size(); k++){
+        // a directory pasted into itself would copy its own copy
+        if (joinPath(targets[k], "").starts_with(joinPath(from[k], ""))){
+            errors.push_back({ from[k], "cannot copy into itself" });
+            continue;
+        }
+        copyFrom.push_back(from[k]);
+        copyTo.push_back(targets[k]);
+    }
+    auto failed = TreeCopy(progress).run(copyFrom, copyTo);
+    errors.insert(errors.end(), failed.begin(), failed.end());
+    return errors;
+}
+
+// report failed files of op in the log and the footer
+static inline void reportErrors(const std::string& op,
+    const std::vector<OpError>& errors)
+{
+    for (const auto& e : errors){
+        FElog.add(op + " " + e.path + ": " + e.error);
+    }
+    if (errors.size() == 1){
+        exitError(op + " " + errors[0].path, errors[0].error);
+    }else if (errors.size()){
+        exitError(op, std::to_string(errors.size()) + " files failed, " +
+            errors[0].path + ": " + errors[0].error);
+    }
+}
+
+#endif
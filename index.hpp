@@ -0,0 +1,411 @@
+#ifndef _INDEX_HPP_
+#define _INDEX_HPP_
+
+#include "cache.hpp"
+#include "scan.hpp"
+
+// locate style index of directory trees, mapped read-only from disk
+// layout: Header, DirRecord[dirs], EntryRecord[entries], names
+// directories are stored in depth first preorder, so the directories of
+// a subtree are one contiguous range, and their entries are too. A search
+// below any indexed directory is a linear scan over that range.
+class FileIndex{
+    public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    struct Header{
+        char magic[8];
+        uint32_t version;
+        uint32_t unused;
+        // when the index was written, for the racily clean check
+        int64_t built;
+        uint64_t dirs;
+        uint64_t entries;
+        uint64_t names;
+    };
+
+    struct DirRecord{
+        // NONE for roots
+        uint32_t parent;
+        // offset into names: full path for roots, otherwise the name
+        uint32_t name;
+        // one past the last directory of the subtree
+        uint32_t end;
+        uint32_t firstEntry;
+        uint32_t entryCount;
+        uint32_t unused;
+        int64_t mtime[2];
+        int64_t ctime[2];
+    };
+
+    struct EntryRecord{
+        uint32_t name;
+        uint32_t mode;
+        int64_t size;
+        int64_t mtime[2];
+    };
+
+    static constexpr char MAGIC[8] = {
+        'F', 'E', 'I', 'N', 'D', 'E', 'X', 0
+    };
+    static constexpr uint32_t VERSION = 2;
+
+    private:
+    void* map = MAP_FAILED;
+    size_t mapSize = 0;
+    const Header* header = NULL;
+    const DirRecord* dirs = NULL;
+    const EntryRecord* entries = NULL;
+    const char* names = NULL;
+
+    public:
+    FileIndex() = default;
+
+    ~FileIndex(){
+        close();
+    }
+
+    FileIndex(const FileIndex&) = delete;
+    FileIndex& operator=(const FileIndex&) = delete;
+
+    // map the index at path, false if there is none or it is not valid
+    bool open(const std::string& path){
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1){
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(Header)){
+            ::close(fd);
+            return false;
+        }
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED){
+            return false;
+        }
+        mapSize = st.st_size;
+
+        header = (const Header*)map;
+        size_t need = sizeof(Header) +
+            header->dirs * sizeof(DirRecord) +
+            header->entries * sizeof(EntryRecord) + header->names;
+        if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) ||
+            header->version != VERSION || need > mapSize)
+        {
+            FElog.add("invalid index: " + path);
+            close();
+            return false;
+        }
+        dirs = (const DirRecord*)(header + 1);
+        entries = (const EntryRecord*)(dirs + header->dirs);
+        names = (const char*)(entries + header->entries);
+        return true;
+    }
+
+    void close(){
+        if (map != MAP_FAILED){
+            munmap(map, mapSize);
+        }
+        map = MAP_FAILED;
+        mapSize = 0;
+        header = NULL;
+    }
+
+    bool ok(){
+        return header;
+    }
+
+    size_t dirCount(){
+        return header ? header->dirs : 0;
+    }
+
+    time_t built(){
+        return header->built;
+    }
+
+    const DirRecord& dir(size_t d){
+        return dirs[d];
+    }
+
+    const EntryRecord& entry(size_t e){
+        return entries[e];
+    }
+
+    const char* name(uint32_t offset){
+        return names + offset;
+    }
+
+    // full path of directory d, ending with '/'
+    std::string dirPath(size_t d){
+        if (dirs[d].parent == NONE){
+            return name(dirs[d].name);
+        }
+        return dirPath(dirs[d].parent) + name(dirs[d].name) + '/';
+    }
+
+    std::vector<std::string> roots(){
+        std::vector<std::string> paths;
+        for (size_t d = 0; d < dirCount(); d = dirs[d].end){
+            paths.push_back(dirPath(d));
+        }
+        return paths;
+    }
+
+    DirStamp stamp(size_t d){
+        DirStamp s;
+        s.mtime = { (time_t)dirs[d].mtime[0], (long)dirs[d].mtime[1] };
+        s.ctime = { (time_t)dirs[d].ctime[0], (long)dirs[d].ctime[1] };
+        return s;
+    }
+
+    // subdirectory of d called name, NONE if there is none
+    uint32_t child(size_t d, std::string_view childName){
+        for (size_t c = d + 1; c < dirs[d].end; c = dirs[c].end){
+            if (childName == name(dirs[c].name)){
+                return c;
+            }
+        }
+        return NONE;
+    }
+
+    // indexed directory at path, NONE if path is not below a root
+    uint32_t find(std::string path){
+        path = joinPath(path, "");
+        for (size_t r = 0; r < dirCount(); r = dirs[r].end){
+            std::string root = name(dirs[r].name);
+            if (!path.starts_with(root)){
+                continue;
+            }
+            uint32_t d = r;
+            size_t begin = root.length();
+            while (d != NONE && begin < path.length()){
+                size_t end = path.find('/', begin);
+                auto component =
+                    std::string_view(path).substr(begin, end - begin);
+                d = child(d, component);
+                begin = end + 1;
+            }
+            if (d != NONE){
+                return d;
+            }
+        }
+        return NONE;
+    }
+
+    // call onEntry(dir, entry) for every entry below directory d
+    template<typename OnEntry>
+    void scan(size_t d, OnEntry onEntry){
+        for (size_t sub = d; sub < dirs[d].end; sub++){
+            size_t first = dirs[sub].firstEntry;
+            for (size_t e = first; e < first + dirs[sub].entryCount; e++){
+                onEntry(sub, e);
+            }
+        }
+    }
+};
+
+// writes a new index of the given roots on its own thread
+// directories whose timestamps match the previous index are not read
+// again, their entries are copied over; only changed directories cost a
+// getdents and lstat round
+class IndexBuilder{
+    std::string path;
+    std::vector<std::string> roots;
+    FileIndex old;
+    time_t oldBuilt = 0;
+
+    std::vector<FileIndex::DirRecord> dirs;
+    std::vector<FileIndex::EntryRecord> entries;
+    std::vector<char> names;
+
+    std::thread thread;
+    std::atomic<bool> cancelled = false;
+    std::atomic<bool> finished = false;
+    std::atomic<size_t> dirCount = 0;
+    std::atomic<size_t> readCount = 0;
+    // set on the builder thread, read once finished
+    std::string error;
+
+    uint32_t addName(std::string_view name){
+        uint32_t offset = names.size();
+        names.insert(names.end(), name.begin(), name.end());
+        names.push_back(0);
+        return offset;
+    }
+
+    // index directory name below parentfd, oldDir is its previous record
+    void build(int parentfd, const char* name, uint32_t parent,
+        uint32_t oldDir)
+    {
+        if (cancelled){
+            return;
+        }
+        DirReader reader(parentfd, name);
+        uint32_t d = dirs.size();
+        dirs.push_back({});
+        dirs[d].parent = parent;
+        dirs[d].name = addName(name);
+        dirs[d].firstEntry = entries.size();
+        dirCount++;
+
+        struct stat st;
+        if (!reader.ok() || fstat(reader.getfd(), &st) == -1){
+            // left with zero timestamps, read again next time
+            dirs[d].end = dirs.size();
+            return;
+        }
+        auto stamp = DirStamp::of(st);
+
+        std::vector<std::string> subdirs;
+        if (oldDir != FileIndex::NONE && old.stamp(oldDir) == stamp &&
+            stamp.mtime.tv_sec < oldBuilt && stamp.ctime.tv_sec < oldBuilt)
+        {
+            size_t first = old.dir(oldDir).firstEntry;
+            size_t count = old.dir(oldDir).entryCount;
+            for (size_t e = first; e < first + count; e++){
+                auto entry = old.entry(e);
+                const char* entryName = old.name(entry.name);
+                entry.name = addName(entryName);
+                entries.push_back(entry);
+                if (S_ISDIR(entry.mode)){
+                    subdirs.push_back(entryName);
+                }
+            }
+        }else{
+            readCount++;
+            StatBatch batch;
+            reader.read([&](const char* entryName, unsigned char){
+                batch.add(reader.getfd(), entryName, Stat::ALL);
+            });
+            batch.run([&](size_t i, Stat st){
+                // gone since it was read
+                if (st.error){
+                    return;
+                }
+                entries.push_back({
+                    addName(batch.name(i)), (uint32_t)st.mode, st.size,
+                    { st.mtime.tv_sec, st.mtime.tv_nsec }
+                });
+                if (S_ISDIR(st.mode)){
+                    subdirs.push_back(batch.name(i));
+                }
+            });
+        }
+        dirs[d].entryCount = entries.size() - dirs[d].firstEntry;
+        dirs[d].mtime[0] = stamp.mtime.tv_sec;
+        dirs[d].mtime[1] = stamp.mtime.tv_nsec;
+        dirs[d].ctime[0] = stamp.ctime.tv_sec;
+        dirs[d].ctime[1] = stamp.ctime.tv_nsec;
+
+        for (const auto& sub : subdirs){
+            uint32_t oldSub = oldDir == FileIndex::NONE ?
+                FileIndex::NONE : old.child(oldDir, sub);
+            build(reader.getfd(), sub.c_str(), d, oldSub);
+        }
+        dirs[d].end = dirs.size();
+    }
+
+    bool write(time_t built){
+        auto tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            0644);
+        if (fd == -1){
+            error = tmp + ": " + strerror(errno);
+            return false;
+        }
+        FileIndex::Header header = {};
+        memcpy(header.magic, FileIndex::MAGIC, sizeof(header.magic));
+        header.version = FileIndex::VERSION;
+        header.built = built;
+        header.dirs = dirs.size();
+        header.entries = entries.size();
+        header.names = names.size();
+
+        std::pair<const void*, size_t> parts[] = {
+            { &header, sizeof(header) },
+            { dirs.data(), dirs.size() * sizeof(dirs[0]) },
+            { entries.data(), entries.size() * sizeof(entries[0]) },
+            { names.data(), names.size() },
+        };
+        for (auto [data, size] : parts){
+            auto p = (const char*)data;
+            while (size){
+                ssize_t n = ::write(fd, p, size);
+                if (n == -1){
+                    error = tmp + ": " + strerror(errno);
+                    ::close(fd);
+                    unlink(tmp.c_str());
+                    return false;
+                }
+                p += n;
+                size -= n;
+            }
+        }
+        ::close(fd);
+        // readers still see the old index until the rename
+        if (rename(tmp.c_str(), path.c_str()) == -1){
+            error = path + ": " + strerror(errno);
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    void work(){
+        // anything changed from now on has a later timestamp
+        time_t built = time(NULL);
+        for (const auto& root : roots){
+            // roots are stored with their full path as name
+            std::string base = joinPath(root, "");
+            uint32_t oldRoot = old.ok() ? old.find(base) : FileIndex::NONE;
+            build(AT_FDCWD, base.c_str(), FileIndex::NONE, oldRoot);
+        }
+        if (!cancelled){
+            write(built);
+        }
+        finished = true;
+    }
+
+    public:
+    // roots are absolute paths; the previous index at path is reused
+    IndexBuilder(const std::string& path,
+        const std::vector<std::string>& roots):
+        path(path), roots(roots)
+    {
+        if (old.open(path)){
+            oldBuilt = old.built();
+        }
+    }
+
+    ~IndexBuilder(){
+        cancelled = true;
+        if (thread.joinable()){
+            thread.join();
+        }
+    }
+
+    void start(){
+        thread = std::thread([this](){ work(); });
+    }
+
+    bool done(){
+        return finished;
+    }
+
+    // empty unless writing the index failed, valid once done
+    const std::string& getError(){
+        return error;
+    }
+
+    // directories indexed and actually read so far
+    size_t indexed(){
+        return dirCount;
+    }
+    size_t reread(){
+        return readCount;
+    }
+};
+
+#endif
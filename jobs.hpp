@@ -0,0 +1,199 @@
+#ifndef _JOBS_HPP_
+#define _JOBS_HPP_
+
+#include "fileop.hpp"
+
+// seconds as "1h 02m", "3m 20s" or "12s"
+static inline std::string durationStr(long seconds){
+    char buf[32];
+    if (seconds >= 3600){
+        sprintf(buf, "%ldh %02ldm", seconds / 3600, seconds / 60 % 60);
+    }else if (seconds >= 60){
+        sprintf(buf, "%ldm %02lds", seconds / 60, seconds % 60);
+    }else{
+        sprintf(buf, "%lds", seconds);
+    }
+    return buf;
+}
+
+// a file operation running on its own thread
+// the work only touches the filesystem and its progress, the explorer
+// follows the changes through its watcher and takes the errors once done
+class Job{
+    public:
+    using Work = std::function<std::vector<OpError>(OpProgress&)>;
+
+    private:
+    size_t id;
+    std::string name;
+    Work work;
+    OpProgress progress;
+    std::thread thread;
+    std::atomic<bool> finished = false;
+    std::chrono::steady_clock::time_point started;
+    // set on the job thread, read once finished
+    std::vector<OpError> errors;
+
+    public:
+    Job(size_t id, const std::string& name, Work work):
+        id(id), name(name), work(std::move(work)) {}
+
+    ~Job(){
+        progress.cancelled = true;
+        if (thread.joinable()){
+            thread.join();
+        }
+    }
+
+    void start(){
+        started = std::chrono::steady_clock::now();
+        thread = std::thread([this](){
+            errors = work(progress);
+            finished = true;
+        });
+    }
+
+    size_t getId() const {
+        return id;
+    }
+
+    const std::string& getName() const {
+        return name;
+    }
+
+    bool running() const {
+        return thread.joinable();
+    }
+
+    bool done() const {
+        return finished;
+    }
+
+    void cancel(){
+        progress.cancelled = true;
+    }
+
+    // files that failed, valid once done
+    std::vector<OpError> take(){
+        thread.join();
+        return std::move(errors);
+    }
+
+    // "2 paste: 1.2 GB of 3.4 GB, 120 of 400 files, 150.0 MB/s, 15s left"
+    std::string status() const {
+        auto line = std::to_string(id) + " " + name + ": ";
+        if (!running()){
+            return line + "waiting";
+        }
+        if (progress.cancelled){
+            return line + "cancelling";
+        }
+        size_t files = progress.files, totalFiles = progress.totalFiles;
+        off_t bytes = progress.bytes, totalBytes = progress.totalBytes;
+        double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - started).count();
+        if (totalBytes){
+            line += fileSizeStr(bytes) + " of " + fileSizeStr(totalBytes) +
+                ", ";
+        }
+        line += std::to_string(files) + " of " + std::to_string(totalFiles) +
+            " files";
+        if (seconds < 1){
+            return line;
+        }
+        // data is what takes time where there is any, renames otherwise
+        double done = totalBytes ? bytes : files;
+        double total = totalBytes ? totalBytes : totalFiles;
+        double rate = done / seconds;
+        if (totalBytes){
+            line += ", " + fileSizeStr(rate) + "/s";
+        }else{
+            line += ", " + std::to_string((size_t)rate) + " files/s";
+        }
+        if (rate > 0 && total > done){
+            line += ", " + durationStr((total - done) / rate) + " left";
+        }
+        return line;
+    }
+};
+
+// queued jobs, JOB_THREADS of them run at once in the order they were added
+class Jobs{
+    std::deque<std::unique_ptr<Job>> jobs;
+    size_t nextId = 1;
+
+    void startWaiting(){
+        size_t running = 0;
+        for (auto& job : jobs){
+            if (job->running()){
+                running++;
+            }else if (running < JOB_THREADS){
+                job->start();
+                running++;
+            }
+        }
+    }
+
+    public:
+    size_t add(const std::string& name, Job::Work work){
+        size_t id = nextId++;
+        jobs.push_back(std::make_unique<Job>(id, name, std::move(work)));
+        startWaiting();
+        return id;
+    }
+
+    // finished jobs as name and errors, the waiting ones take their place
+    std::vector<std::pair<std::string, std::vector<OpError>>> take(){
+        std::vector<std::pair<std::string, std::vector<OpError>>> finished;
+        for (auto it = jobs.begin(); it != jobs.end();){
+            if ((*it)->done()){
+                finished.push_back({ (*it)->getName(), (*it)->take() });
+                it = jobs.erase(it);
+            }else{
+                it++;
+            }
+        }
+        if (finished.size()){
+            startWaiting();
+        }
+        return finished;
+    }
+
+    // a waiting job is dropped at once, a running one stops soon
+    // false if there is no job id
+    bool cancel(size_t id){
+        for (auto it = jobs.begin(); it != jobs.end(); it++){
+            if ((*it)->getId() != id){
+                continue;
+            }
+            if ((*it)->running()){
+                (*it)->cancel();
+            }else{
+                jobs.erase(it);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void cancelAll(){
+        std::erase_if(jobs, [](const auto& job){ return !job->running(); });
+        for (auto& job : jobs){
+            job->cancel();
+        }
+    }
+
+    size_t size(){
+        return jobs.size();
+    }
+
+    // f(job) for every job, oldest first
+    template<typename F>
+    void forEach(F f){
+        for (const auto& job : jobs){
+            f(*job);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef _LAYOUT_HPP_
+#define _LAYOUT_HPP_
+
+#include "log.hpp"
+
+// heights of the rows of a list in screen lines
+// kept in a Fenwick tree, so the line a row starts at and the row at a
+// line are found in O(log n) and a row changes height in O(log n)
+class RowLayout{
+    std::vector<size_t> heights;
+    // 1-based, tree[i] sums the heights of rows [i - lowbit(i), i)
+    std::vector<size_t> tree;
+    // highest power of 2 not above the number of rows
+    size_t top = 0;
+
+    static size_t lowbit(size_t i){
+        return i & -i;
+    }
+
+    public:
+    // rows with these heights, built in O(n)
+    void assign(std::vector<size_t>&& rows){
+        heights = std::move(rows);
+        tree.assign(heights.size() + 1, 0);
+        for (size_t i = 1; i <= heights.size(); i++){
+            tree[i] += heights[i - 1];
+            size_t parent = i + lowbit(i);
+            if (parent <= heights.size()){
+                tree[parent] += tree[i];
+            }
+        }
+        top = heights.size() ? std::bit_floor(heights.size()) : 0;
+    }
+
+    size_t size(){
+        return heights.size();
+    }
+
+    size_t height(size_t row){
+        return heights[row];
+    }
+
+    void setHeight(size_t row, size_t height){
+        long delta = height - heights[row];
+        heights[row] = height;
+        for (size_t i = row + 1; i < tree.size(); i += lowbit(i)){
+            tree[i] += delta;
+        }
+    }
+
+    // lines above row, or of all rows if row is size()
+    size_t lineOf(size_t row){
+        size_t line = 0;
+        for (size_t i = row; i; i -= lowbit(i)){
+            line += tree[i];
+        }
+        return line;
+    }
+
+    // row that covers line, size() past the last row
+    size_t rowAt(size_t line){
+        size_t row = 0;
+        for (size_t step = top; step; step >>= 1){
+            if (row + step < tree.size() && tree[row + step] <= line){
+                row += step;
+                line -= tree[row];
+            }
+        }
+        return row;
+    }
+};
+
+#endif
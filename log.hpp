@@ -4,9 +4,19 @@
 
 #include <ncurses.h>
 #include <vector>
+#include <span>
+#include <memory_resource>
+#include <charconv>
 #include <string>
 #include <algorithm>
+#include <numeric>
+#include <array>
+#include <bit>
 #include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <memory>
 #include <regex>
 #include <unistd.h>
 #include <math.h>
@@ -14,14 +24,35 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <magic.h>
+#include <string.h>
+#include <locale.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <unordered_set>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#endif
 #include "config.hpp"
 
 class Log{
     std::vector<std::string> log;
+    // background jobs log as well
+    std::mutex mutex;
     
     public:
     void add(const std::string& str){
         if (ENABLE_LOGGING){
+            std::lock_guard lock(mutex);
             log.push_back(str);
         }
     }
@@ -34,6 +65,9 @@ class Log{
     }
 };
 static Log FElog;
+// heap allocations so far, counted by operator new in main.cpp while
+// ENABLE_LOGGING is set
+inline std::atomic<size_t> heapAllocations = 0;
 static std::string ERROR_STR;
 
 static inline void
@@ -5,6 +5,41 @@
 #include <functional>
 #include <locale.h>
 
+#if ENABLE_LOGGING
+// counts heap allocations for the debug log, see Win::draw()
+// every unaligned form is replaced and none is inlined, so callers pair
+// operator new with operator delete instead of seeing malloc and free;
+// the aligned and nothrow forms of the library go through these or pair
+// among themselves
+__attribute__((noinline)) void* operator new(size_t size){
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)){
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new[](size_t size){
+    return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    operator delete(p);
+}
+
+__attribute__((noinline)) void operator delete[](void* p) noexcept {
+    operator delete(p);
+}
+
+__attribute__((noinline)) void operator delete[](void* p, size_t) noexcept {
+    operator delete(p);
+}
+#endif
+
 void sigVaultPrintLog(int sig){
     endwin();
     FElog.add("Segmentation fault");
@@ -20,10 +55,13 @@ int main(){
     keypad(stdscr, TRUE);
     nonl();
     curs_set(0);
+    // lets the list scroll with the terminal's scroll region
+    idlok(stdscr, TRUE);
     ESCDELAY = 0;
     
     magicInit();
-    Win win = Win().gethw();
+    Win win;
+    win.gethw();
     Explorer explorer;
     Controller controller;
 
@@ -33,7 +71,7 @@ int main(){
     
     do{
         win.setUI(controller, explorer).draw();
-    }while(controller.readInput().control(explorer));
+    }while(controller.readInput(explorer).control(explorer));
     
     endwin();
     magicEnd();
@@ -0,0 +1,96 @@
+#ifndef _POOL_HPP_
+#define _POOL_HPP_
+
+#include "config.hpp"
+#include "log.hpp"
+
+// fixed size pool of worker threads running queued tasks in FIFO order
+class ThreadPool{
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+
+    void work(){
+        while (true){
+            std::function<void()> task;
+            {
+                std::unique_lock lock(mutex);
+                cv.wait(lock, [&](){ return stopping || tasks.size(); });
+                if (!tasks.size()){
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    public:
+    ThreadPool(size_t n){
+        for (size_t i = 0; i < n; i++){
+            threads.emplace_back([this](){ work(); });
+        }
+    }
+
+    ~ThreadPool(){
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& t : threads){
+            t.join();
+        }
+    }
+
+    void submit(std::function<void()> task){
+        {
+            std::lock_guard lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        cv.notify_one();
+    }
+
+    size_t size(){
+        return threads.size();
+    }
+};
+
+static inline size_t workerCount(){
+    if (WORKER_THREADS){
+        return WORKER_THREADS;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// shared pool for short blocking jobs
+// tasks must not wait on other tasks of the same pool
+static inline ThreadPool& workers(){
+    static ThreadPool pool(workerCount());
+    return pool;
+}
+
+// run job(k) for every k in [0, count) on the shared pool and wait for all
+// of them; the calling thread must not be a worker of the pool
+template<typename Job>
+static inline void parallelFor(size_t count, Job job){
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t left = count;
+    for (size_t k = 0; k < count; k++){
+        workers().submit([&, k](){
+            job(k);
+            std::lock_guard lock(mutex);
+            if (--left == 0){
+                cv.notify_one();
+            }
+        });
+    }
+    std::unique_lock lock(mutex);
+    cv.wait(lock, [&](){ return left == 0; });
+}
+
+#endif
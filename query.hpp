@@ -0,0 +1,427 @@
+#ifndef _QUERY_HPP_
+#define _QUERY_HPP_
+
+#include "config.hpp"
+#include "log.hpp"
+#include "simd.hpp"
+
+// set of characters in str, one bit per character folded to 6 bits
+// a name can only contain a query's characters if it has all its bits
+static inline uint64_t charMask(std::string_view str){
+    uint64_t mask = 0;
+    for (char c : str){
+        mask |= 1ull << (foldChar(c) & 63);
+    }
+    return mask;
+}
+
+// search and filter query, compiled once and matched against many names
+// "r:" is a case insensitive regular expression over the whole name,
+// "g:" a glob over the whole name, "i:" an ASCII case insensitive
+// substring, "f:" a fuzzy query and anything else a case sensitive
+// substring. match() is const and safe to call from several threads.
+class Query{
+    public:
+    enum Type{
+        LITERAL,
+        GLOB,
+        REGEX,
+        FUZZY,
+    };
+
+    private:
+    Type type = LITERAL;
+    // literal and fuzzy: pattern is lower case and matched ignoring case
+    bool fold = false;
+    std::string pattern;
+    // regex only: lower case literal every match contains, checked before
+    // running the regex since most names fail it
+    std::string required;
+    std::shared_ptr<const std::regex> regex;
+    std::string error;
+    // fuzzy only: charMask of the pattern
+    uint64_t mask = 0;
+
+    // fuzzy scores, in the spirit of fzf: every matched character scores,
+    // more so at the start of a word or path component and in a run of
+    // matched characters; gaps in between cost a little
+    static constexpr int SCORE_MATCH = 16;
+    static constexpr int SCORE_GAP_START = -3;
+    static constexpr int SCORE_GAP_EXTENSION = -1;
+    static constexpr int BONUS_PATH = 10;
+    static constexpr int BONUS_BOUNDARY = 8;
+    static constexpr int BONUS_CAMEL = 7;
+    static constexpr int BONUS_CONSECUTIVE = 4;
+
+    bool fuzzyEqual(char c, char q) const {
+        return (fold ? foldChar(c) : c) == q;
+    }
+
+    static int boundaryBonus(std::string_view text, size_t i){
+        // the start of the text is the start of a path
+        if (i == 0){
+            return BONUS_PATH;
+        }
+        char prev = text[i - 1];
+        char c = text[i];
+        if (prev == '/'){
+            return BONUS_PATH;
+        }
+        if (!isalnum((unsigned char)prev) && isalnum((unsigned char)c)){
+            return BONUS_BOUNDARY;
+        }
+        if (islower((unsigned char)prev) && isupper((unsigned char)c)){
+            return BONUS_CAMEL;
+        }
+        if (!isdigit((unsigned char)prev) && isdigit((unsigned char)c)){
+            return BONUS_CAMEL;
+        }
+        return 0;
+    }
+
+    // first and one past the last position of the shortest window that
+    // ends at the first complete subsequence match; false if none
+    bool fuzzyWindow(std::string_view text, size_t& begin, size_t& end)
+        const
+    {
+        size_t q = 0;
+        for (end = 0; end < text.length() && q < pattern.length(); end++){
+            if (fuzzyEqual(text[end], pattern[q])){
+                q++;
+            }
+        }
+        if (q < pattern.length()){
+            return false;
+        }
+        // walk back to the latest start that still matches everything
+        begin = end;
+        for (q = pattern.length(); q > 0;){
+            begin--;
+            if (fuzzyEqual(text[begin], pattern[q - 1])){
+                q--;
+            }
+        }
+        return true;
+    }
+
+    // ascii case insensitive substring search, needle is lower case
+    static bool containsFolded(std::string_view hay, std::string_view needle){
+        if (needle.length() > hay.length()){
+            return false;
+        }
+        for (size_t i = 0; i + needle.length() <= hay.length(); i++){
+            size_t k = 0;
+            while (k < needle.length() && foldChar(hay[i + k]) == needle[k]){
+                k++;
+            }
+            if (k == needle.length()){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // longest run of plain characters outside groups and classes that is
+    // not made optional by a quantifier; empty if there is an alternation
+    // or nothing certain to appear
+    static std::string requiredLiteral(const std::string& expr){
+        std::string best, run;
+        auto endRun = [&](){
+            if (run.length() > best.length()){
+                best = run;
+            }
+            run.clear();
+        };
+        int depth = 0;
+        for (size_t i = 0; i < expr.length(); i++){
+            char c = expr[i];
+            char next = i + 1 < expr.length() ? expr[i + 1] : 0;
+            bool optional = next == '?' || next == '*' || next == '{';
+            switch (c){
+                case '|':
+                    return "";
+                case '(':
+                    depth++;
+                    endRun();
+                    break;
+                case ')':
+                    depth--;
+                    endRun();
+                    break;
+                case '[':
+                    // skip the class, "]" right after "[" or "[^" is literal
+                    i++;
+                    if (i < expr.length() && expr[i] == '^') i++;
+                    if (i < expr.length() && expr[i] == ']') i++;
+                    while (i < expr.length() && expr[i] != ']'){
+                        if (expr[i] == '\\') i++;
+                        i++;
+                    }
+                    endRun();
+                    break;
+                case '\\':
+                    // escaped punctuation is literal, \d \w and the like not
+                    if (next && !isalnum((unsigned char)next)){
+                        i++;
+                        next = i + 1 < expr.length() ? expr[i + 1] : 0;
+                        optional = next == '?' || next == '*' || next == '{';
+                        if (depth == 0 && !optional){
+                            run.push_back(foldChar(expr[i]));
+                        }else{
+                            endRun();
+                        }
+                    }else{
+                        i++;
+                        endRun();
+                    }
+                    break;
+                case '{':
+                    // {n,m} counts are not part of the name
+                    while (i < expr.length() && expr[i] != '}') i++;
+                    endRun();
+                    break;
+                case '.': case '^': case '$':
+                case '?': case '*': case '+':
+                    endRun();
+                    break;
+                default:
+                    if (depth == 0 && !optional){
+                        run.push_back(foldChar(c));
+                    }else{
+                        endRun();
+                    }
+            }
+            // a+ still contains one a but nothing after it is adjacent
+            if (next == '+'){
+                endRun();
+            }
+        }
+        endRun();
+        return best;
+    }
+
+    // [...] at pattern[p], p is moved past it; false if c is not in it
+    static bool matchClass(std::string_view pattern, size_t& p, char c){
+        size_t i = p + 1;
+        bool negate = i < pattern.length() &&
+            (pattern[i] == '!' || pattern[i] == '^');
+        if (negate) i++;
+        bool found = false;
+        bool first = true;
+        while (i < pattern.length() && (first || pattern[i] != ']')){
+            first = false;
+            char lo = pattern[i];
+            if (lo == '\\' && i + 1 < pattern.length()){
+                lo = pattern[++i];
+            }
+            char hi = lo;
+            if (i + 2 < pattern.length() && pattern[i + 1] == '-' &&
+                pattern[i + 2] != ']')
+            {
+                hi = pattern[i + 2];
+                i += 2;
+            }
+            if (c >= lo && c <= hi){
+                found = true;
+            }
+            i++;
+        }
+        p = i + 1;
+        return found != negate;
+    }
+
+    // whole name glob match with *, ?, [...] and \ escapes
+    // a failed match after * resumes one character further instead of
+    // recursing, so it stays linear in practice
+    static bool matchGlob(std::string_view pattern, std::string_view name){
+        size_t p = 0, n = 0;
+        size_t starP = std::string_view::npos, starN = 0;
+        while (n < name.length()){
+            if (p < pattern.length()){
+                char c = pattern[p];
+                if (c == '*'){
+                    starP = ++p;
+                    starN = n;
+                    continue;
+                }
+                if (c == '?'){
+                    p++;
+                    n++;
+                    continue;
+                }
+                if (c == '[' && pattern.find(']', p + 2) !=
+                    std::string_view::npos)
+                {
+                    size_t next = p;
+                    if (matchClass(pattern, next, name[n])){
+                        p = next;
+                        n++;
+                        continue;
+                    }
+                }else{
+                    if (c == '\\' && p + 1 < pattern.length()){
+                        c = pattern[p + 1];
+                        if (c == name[n]){
+                            p += 2;
+                            n++;
+                            continue;
+                        }
+                    }else if (c == name[n]){
+                        p++;
+                        n++;
+                        continue;
+                    }
+                }
+            }
+            if (starP == std::string_view::npos){
+                return false;
+            }
+            p = starP;
+            n = ++starN;
+        }
+        while (p < pattern.length() && pattern[p] == '*'){
+            p++;
+        }
+        return p == pattern.length();
+    }
+
+    public:
+    Query() = default;
+
+    Query(const std::string& query){
+        if (query.starts_with("r:")){
+            type = REGEX;
+            pattern = query.substr(2);
+            try {
+                regex = std::make_shared<const std::regex>(pattern,
+                    std::regex_constants::ECMAScript |
+                    std::regex_constants::icase |
+                    std::regex_constants::optimize);
+            }catch(const std::regex_error& e){
+                error = e.what();
+                return;
+            }
+            required = requiredLiteral(pattern);
+        }else if (query.starts_with("g:")){
+            type = GLOB;
+            pattern = query.substr(2);
+        }else if (query.starts_with("f:")){
+            // smart case: ignore case unless the query has upper case
+            type = FUZZY;
+            pattern = query.substr(2);
+            fold = std::none_of(pattern.begin(), pattern.end(),
+                [](char c){ return c >= 'A' && c <= 'Z'; });
+            mask = charMask(pattern);
+        }else if (query.starts_with("i:")){
+            fold = true;
+            for (char c : query.substr(2)){
+                pattern.push_back(foldChar(c));
+            }
+        }else{
+            pattern = query;
+        }
+    }
+
+    Type getType() const {
+        return type;
+    }
+
+    // plain substring, see text() and folded()
+    bool isLiteral() const {
+        return type == LITERAL;
+    }
+
+    // the substring of a literal query, lower case if folded()
+    const std::string& text() const {
+        return pattern;
+    }
+
+    bool folded() const {
+        return fold;
+    }
+
+    // every name this query matches is also matched by wider
+    // only known for substrings: a longer substring narrows a shorter one
+    bool narrows(const Query& wider) const {
+        return type == LITERAL && wider.type == LITERAL &&
+            fold == wider.fold && wider.valid() &&
+            pattern.find(wider.pattern) != std::string::npos;
+    }
+
+    // matches every name
+    bool empty() const {
+        return type == LITERAL && pattern == "";
+    }
+
+    bool valid() const {
+        return error == "";
+    }
+
+    // why the query could not be compiled; invalid queries match nothing
+    const std::string& getError() const {
+        return error;
+    }
+
+    // prefilter: the charMask a name needs to be able to match
+    // zero for queries other than fuzzy
+    uint64_t needs() const {
+        return type == FUZZY ? mask : 0;
+    }
+
+    // fuzzy score of text, higher is better; -1 if it does not match
+    int score(std::string_view text) const {
+        size_t begin, end;
+        if (type != FUZZY || !fuzzyWindow(text, begin, end)){
+            return -1;
+        }
+        int total = 0;
+        int run = 0;
+        bool inGap = false;
+        size_t q = 0;
+        for (size_t i = begin; i < end; i++){
+            if (q < pattern.length() && fuzzyEqual(text[i], pattern[q])){
+                int bonus = boundaryBonus(text, i);
+                if (run){
+                    bonus = std::max(bonus, BONUS_CONSECUTIVE);
+                }
+                // the first query character counts double, fzf does the
+                // same so that typing the start of a word ranks it first
+                total += SCORE_MATCH + (q == 0 ? bonus * 2 : bonus);
+                run++;
+                inGap = false;
+                q++;
+            }else{
+                total += inGap ? SCORE_GAP_EXTENSION : SCORE_GAP_START;
+                run = 0;
+                inGap = true;
+            }
+        }
+        return std::max(total, 0);
+    }
+
+    bool match(std::string_view name) const {
+        switch (type){
+            case LITERAL:
+                if (fold){
+                    return containsFolded(name, pattern);
+                }
+                return name.find(pattern) != std::string_view::npos;
+            case GLOB:
+                return matchGlob(pattern, name);
+            case REGEX:
+                if (!regex){
+                    return false;
+                }
+                if (required.length() && !containsFolded(name, required)){
+                    return false;
+                }
+                return std::regex_match(name.begin(), name.end(), *regex);
+            case FUZZY:
+                size_t begin, end;
+                return fuzzyWindow(name, begin, end);
+        }
+        return false;
+    }
+};
+
+#endif
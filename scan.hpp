@@ -0,0 +1,227 @@
+#ifndef _SCAN_HPP_
+#define _SCAN_HPP_
+
+#include "config.hpp"
+#include "log.hpp"
+#include "statx.hpp"
+
+#ifdef __linux__
+struct linux_dirent64{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+// reads the entries of a directory through an open fd
+// on linux entries come from getdents64 into one large buffer, so a
+// directory is read with a handful of syscalls. d_type is passed on as
+// is; callers only need lstat when it is DT_UNKNOWN.
+class DirReader{
+    int fd = -1;
+
+#ifdef __linux__
+    static constexpr size_t BUFFER_SIZE = 1 << 17;
+    std::vector<char> buf;
+#else
+    static constexpr size_t BATCH = 4096;
+    DIR* dir = NULL;
+#endif
+
+    static bool isDot(const char* name){
+        return name[0] == '.' &&
+            (name[1] == 0 || (name[1] == '.' && name[2] == 0));
+    }
+
+    public:
+    // path is relative to dirfd
+    DirReader(int dirfd, const char* path){
+        fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    ~DirReader(){
+#ifndef __linux__
+        if (dir){
+            closedir(dir);
+        }
+#endif
+        if (fd >= 0){
+            close(fd);
+        }
+    }
+
+    DirReader(const DirReader&) = delete;
+    DirReader& operator=(const DirReader&) = delete;
+
+    bool ok(){
+        return fd >= 0;
+    }
+
+    int getfd(){
+        return fd;
+    }
+
+    // call onEntry(name, d_type) for the next batch of entries
+    // "." and ".." are skipped unless withDots is set
+    // returns false once the directory is exhausted or on error
+    template<typename OnEntry>
+    bool next(OnEntry onEntry, bool withDots = false){
+#ifdef __linux__
+        buf.resize(BUFFER_SIZE);
+        long n = syscall(SYS_getdents64, fd, buf.data(), buf.size());
+        if (n <= 0){
+            return false;
+        }
+        for (long off = 0; off < n;){
+            auto d = (linux_dirent64*)(buf.data() + off);
+            off += d->d_reclen;
+            if (!withDots && isDot(d->d_name)){
+                continue;
+            }
+            onEntry((const char*)d->d_name, d->d_type);
+        }
+        return true;
+#else
+        if (!dir){
+            dir = fdopendir(dup(fd));
+            if (!dir){
+                return false;
+            }
+        }
+        struct dirent* entry;
+        for (size_t n = 0; n < BATCH; n++){
+            if (!(entry = readdir(dir))){
+                return false;
+            }
+            if (!withDots && isDot(entry->d_name)){
+                continue;
+            }
+            onEntry((const char*)entry->d_name, entry->d_type);
+        }
+        return true;
+#endif
+    }
+
+    // call onEntry(name, d_type) for every entry
+    template<typename OnEntry>
+    void read(OnEntry onEntry, bool withDots = false){
+        while (next(onEntry, withDots));
+    }
+};
+
+// reads a directory on its own thread and hands entries over in chunks
+// the directory fd stays open until the Loader is destroyed, so symlinks
+// of handed over entries can still be read relative to it
+class Loader{
+    public:
+    struct Entry{
+        std::string name;
+        Stat stat;
+    };
+
+    private:
+    DirReader reader;
+    std::thread thread;
+    std::mutex mutex;
+    std::vector<Entry> ready;
+    std::atomic<bool> cancelled = false;
+    std::atomic<bool> finished = false;
+    std::atomic<size_t> count = 0;
+    std::condition_variable cv;
+
+    void work(){
+        std::vector<Entry> chunk;
+        std::vector<unsigned char> types;
+        bool more = true;
+        while (more && !cancelled){
+            StatBatch batch;
+            types.clear();
+            more = reader.next([&](const char* name, unsigned char type){
+                // type is known from d_type, lstat is only needed for size
+                // and modification time
+                batch.add(reader.getfd(), name,
+                    type == DT_UNKNOWN ? Stat::ALL : Stat::SIZE | Stat::TIME);
+                types.push_back(type);
+            }, true);
+
+            chunk.resize(batch.size());
+            batch.run([&](size_t i, Stat st){
+                if (types[i] != DT_UNKNOWN){
+                    st.mode = DTTOIF(types[i]);
+                }
+                chunk[i] = {batch.name(i), st};
+            });
+
+            std::lock_guard lock(mutex);
+            count += chunk.size();
+            std::move(chunk.begin(), chunk.end(), std::back_inserter(ready));
+            chunk.clear();
+        }
+        std::lock_guard lock(mutex);
+        finished = true;
+        cv.notify_all();
+    }
+
+    public:
+    Loader(int dirfd): reader(dirfd, "."){
+        if (!reader.ok()){
+            finished = true;
+        }
+    }
+
+    void start(){
+        if (reader.ok()){
+            thread = std::thread([this](){ work(); });
+        }
+    }
+
+    ~Loader(){
+        cancel();
+        if (thread.joinable()){
+            thread.join();
+        }
+    }
+
+    bool ok(){
+        return reader.ok();
+    }
+
+    int getfd(){
+        return reader.getfd();
+    }
+
+    // stop after the chunk being read
+    void cancel(){
+        cancelled = true;
+    }
+
+    // wait up to ms milliseconds for the whole directory
+    bool wait(int ms){
+        std::unique_lock lock(mutex);
+        return cv.wait_for(lock, std::chrono::milliseconds(ms),
+            [&](){ return (bool)finished; });
+    }
+
+    // entries read since the last call
+    std::vector<Entry> take(){
+        std::lock_guard lock(mutex);
+        std::vector<Entry> entries;
+        entries.swap(ready);
+        return entries;
+    }
+
+    // all entries are read (or loading stopped) and taken
+    bool done(){
+        std::lock_guard lock(mutex);
+        return finished && !ready.size();
+    }
+
+    // entries read so far
+    size_t loaded(){
+        return count;
+    }
+};
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef _SELECT_HPP_
+#define _SELECT_HPP_
+
+#include "log.hpp"
+
+// selected entries of a listing, one bit per entry index
+// the count and total size follow every change, so showing them never
+// needs a pass over the listing
+class Selection{
+    std::vector<uint64_t> words;
+    size_t count = 0;
+    off_t bytes = 0;
+
+    public:
+    bool contains(size_t i) const {
+        return i / 64 < words.size() && (words[i / 64] >> (i % 64) & 1);
+    }
+
+    // size is that of entry i, it counts while the entry is selected
+    void set(size_t i, off_t size, bool selected){
+        if (contains(i) == selected){
+            return;
+        }
+        if (i / 64 >= words.size()){
+            words.resize(i / 64 + 1);
+        }
+        words[i / 64] ^= 1ull << (i % 64);
+        if (selected){
+            count++;
+            bytes += size;
+        }else{
+            count--;
+            bytes -= size;
+        }
+    }
+
+    void toggle(size_t i, off_t size){
+        set(i, size, !contains(i));
+    }
+
+    // entry i changed its size
+    void resize(size_t i, off_t before, off_t after){
+        if (contains(i)){
+            bytes += after - before;
+        }
+    }
+
+    void clear(){
+        words.clear();
+        count = 0;
+        bytes = 0;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    off_t totalSize() const {
+        return bytes;
+    }
+
+    // f(i) for every selected entry in index order, a word at a time
+    template<typename F>
+    void forEach(F f) const {
+        for (size_t w = 0; w < words.size(); w++){
+            for (uint64_t word = words[w]; word; word &= word - 1){
+                f(w * 64 + std::countr_zero(word));
+            }
+        }
+    }
+};
+
+// selected files of listings that are not shown, by full path
+// sorted so that those below a directory are found without a scan
+class SelectedPaths{
+    std::map<std::string, off_t> paths;
+    off_t bytes = 0;
+
+    public:
+    void add(const std::string& path, off_t size){
+        auto [it, added] = paths.emplace(path, size);
+        if (added){
+            bytes += size;
+        }
+    }
+
+    // take path out of the set, false if it is not in it
+    bool take(const std::string& path){
+        auto found = paths.find(path);
+        if (found == paths.end()){
+            return false;
+        }
+        bytes -= found->second;
+        paths.erase(found);
+        return true;
+    }
+
+    // some path starts with dir
+    bool below(const std::string& dir) const {
+        auto found = paths.lower_bound(dir);
+        return found != paths.end() && found->first.starts_with(dir);
+    }
+
+    void clear(){
+        paths.clear();
+        bytes = 0;
+    }
+
+    size_t size() const {
+        return paths.size();
+    }
+
+    off_t totalSize() const {
+        return bytes;
+    }
+
+    // f(path) for every path in order
+    template<typename F>
+    void forEach(F f) const {
+        for (const auto& [path, size] : paths){
+            f(path);
+        }
+    }
+};
+
+#endif
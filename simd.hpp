@@ -0,0 +1,188 @@
+#ifndef _SIMD_HPP_
+#define _SIMD_HPP_
+
+#include "config.hpp"
+#include "log.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FE_X86 1
+#endif
+
+// substring search over NUL separated names packed in one buffer
+// candidates are found a vector at a time by comparing the first and the
+// last byte of the needle at every position, and only positions where
+// both agree are compared in full. The AVX2 or SSE2 version is picked at
+// runtime, with a scalar version for other cpus.
+//
+// hits gets the offset of the first match in each name; the search skips
+// to the next name after a hit. With fold set, ASCII letters match
+// regardless of case; needle must then be lower case.
+
+static inline char foldChar(char c){
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// full compare of a candidate position
+static inline bool equalAt(const char* p, const char* needle, size_t n,
+    bool fold)
+{
+    if (!fold){
+        return !memcmp(p, needle, n);
+    }
+    for (size_t k = 0; k < n; k++){
+        if (foldChar(p[k]) != needle[k]){
+            return false;
+        }
+    }
+    return true;
+}
+
+// first position at or after pos that is past the end of its name
+static inline size_t nextName(const char* buf, size_t len, size_t pos){
+    auto end = (const char*)memchr(buf + pos, 0, len - pos);
+    return end ? end - buf + 1 : len;
+}
+
+static inline void findInNamesScalar(const char* buf, size_t len,
+    const char* needle, size_t n, bool fold, std::vector<uint32_t>& hits)
+{
+    for (size_t i = 0; i + n <= len;){
+        char c = fold ? foldChar(buf[i]) : buf[i];
+        if (c == needle[0] && equalAt(buf + i, needle, n, fold)){
+            hits.push_back(i);
+            i = nextName(buf, len, i);
+            continue;
+        }
+        i++;
+    }
+}
+
+#ifdef FE_X86
+// lower case ASCII letters of 16 or 32 bytes
+// bytes >= 0x80 are negative as signed and never count as upper case
+__attribute__((target("sse2")))
+static inline __m128i fold128(__m128i x){
+    __m128i upper = _mm_and_si128(
+        _mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)),
+        _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), x));
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i fold256(__m256i x){
+    __m256i upper = _mm256_and_si256(
+        _mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+    return _mm256_or_si256(x,
+        _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("sse2")))
+static void findInNamesSSE2(const char* buf, size_t len,
+    const char* needle, size_t n, bool fold, std::vector<uint32_t>& hits)
+{
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[n - 1]);
+    size_t i = 0;
+    while (i + n - 1 + 16 <= len){
+        __m128i a = _mm_loadu_si128((const __m128i*)(buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(buf + i + n - 1));
+        if (fold){
+            a = fold128(a);
+            b = fold128(b);
+        }
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        size_t next = i + 16;
+        while (mask){
+            size_t pos = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (equalAt(buf + pos, needle, n, fold)){
+                hits.push_back(pos);
+                next = nextName(buf, len, pos);
+                break;
+            }
+        }
+        i = next;
+    }
+    if (i < len){
+        std::vector<uint32_t> rest;
+        findInNamesScalar(buf + i, len - i, needle, n, fold, rest);
+        for (auto r : rest){
+            hits.push_back(i + r);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void findInNamesAVX2(const char* buf, size_t len,
+    const char* needle, size_t n, bool fold, std::vector<uint32_t>& hits)
+{
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[n - 1]);
+    size_t i = 0;
+    while (i + n - 1 + 32 <= len){
+        __m256i a = _mm256_loadu_si256((const __m256i*)(buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(buf + i + n - 1));
+        if (fold){
+            a = fold256(a);
+            b = fold256(b);
+        }
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        size_t next = i + 32;
+        while (mask){
+            size_t pos = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (equalAt(buf + pos, needle, n, fold)){
+                hits.push_back(pos);
+                next = nextName(buf, len, pos);
+                break;
+            }
+        }
+        i = next;
+    }
+    if (i < len){
+        std::vector<uint32_t> rest;
+        findInNamesScalar(buf + i, len - i, needle, n, fold, rest);
+        for (auto r : rest){
+            hits.push_back(i + r);
+        }
+    }
+}
+#endif
+
+using FindInNames = void (*)(const char*, size_t, const char*, size_t, bool,
+    std::vector<uint32_t>&);
+
+// best version for this cpu, chosen once
+static inline FindInNames findInNamesImpl(){
+    static FindInNames impl = [](){
+#ifdef FE_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")){
+            FElog.add("name search: avx2");
+            return (FindInNames)findInNamesAVX2;
+        }
+        if (__builtin_cpu_supports("sse2")){
+            FElog.add("name search: sse2");
+            return (FindInNames)findInNamesSSE2;
+        }
+#endif
+        FElog.add("name search: scalar");
+        return (FindInNames)findInNamesScalar;
+    }();
+    return impl;
+}
+
+static inline void findInNames(const char* buf, size_t len,
+    std::string_view needle, bool fold, std::vector<uint32_t>& hits)
+{
+    if (!needle.length()){
+        return;
+    }
+    findInNamesImpl()(buf, len, needle.data(), needle.length(), fold, hits);
+}
+
+#endif
@@ -0,0 +1,467 @@
+#ifndef _SORT_HPP_
+#define _SORT_HPP_
+
+#include "table.hpp"
+#include "pool.hpp"
+
+// byte strings back to back, one per entry, like the names of EntryTable
+class KeyArena{
+    std::vector<char> bytes;
+    // one more than there are keys, key k is [offset[k], offset[k + 1])
+    std::vector<uint32_t> offset = { 0 };
+
+    public:
+    void clear(){
+        bytes.clear();
+        offset = { 0 };
+    }
+
+    size_t size(){
+        return offset.size() - 1;
+    }
+
+    void append(const std::string& buf, const std::vector<uint32_t>& ends){
+        uint32_t base = bytes.size();
+        bytes.insert(bytes.end(), buf.begin(), buf.end());
+        for (auto end : ends){
+            offset.push_back(base + end);
+        }
+    }
+
+    std::string_view get(size_t k){
+        return std::string_view(bytes.data() + offset[k],
+            offset[k + 1] - offset[k]);
+    }
+};
+
+// key whose byte order is natural order, digit runs compare by value so
+// "file9" comes before "file10". Leading zeros are dropped and every run
+// is preceded by its length as a digit-like byte, so longer numbers sort
+// after shorter ones; runs over 16 digits share a length byte.
+static inline void naturalKey(std::string_view name, std::string& out){
+    for (size_t i = 0; i < name.length();){
+        if (!isdigit((unsigned char)name[i])){
+            out.push_back(name[i++]);
+            continue;
+        }
+        size_t end = i;
+        while (end < name.length() && isdigit((unsigned char)name[end])){
+            end++;
+        }
+        while (i + 1 < end && name[i] == '0'){
+            i++;
+        }
+        out.push_back('0' + std::min<size_t>(end - i, 16));
+        out.append(name.substr(i, end - i));
+        i = end;
+    }
+}
+
+// strxfrm(3) key of name in the LC_COLLATE locale
+// name must be followed by a NUL, as names of EntryTable are
+static inline void collationKey(std::string_view name, std::string& out){
+    size_t n = strxfrm(NULL, name.data(), 0);
+    size_t at = out.size();
+    out.resize(at + n + 1);
+    strxfrm(&out[at], name.data(), n + 1);
+    out.resize(at + n);
+}
+
+// first 8 bytes of key as a big endian number, zero padded
+// numbers compare like the keys do unless the keys share 8 bytes
+static inline uint64_t prefixOf(std::string_view key){
+    uint64_t p = 0;
+    for (size_t k = 0; k < 8; k++){
+        p = p << 8 | (k < key.length() ? (unsigned char)key[k] : 0);
+    }
+    return p;
+}
+
+// stable LSD radix sort of v by key(v[k]), a byte at a time
+// bytes every key has in common are skipped, so small ranges such as
+// file types cost one pass
+template<typename Key>
+static inline void radixSort(std::vector<size_t>& v, Key key){
+    size_t n = v.size();
+    if (n < 2){
+        return;
+    }
+    std::vector<std::pair<uint64_t, size_t>> a(n), b(n);
+    for (size_t k = 0; k < n; k++){
+        a[k] = { key(v[k]), v[k] };
+    }
+    for (int shift = 0; shift < 64; shift += 8){
+        size_t count[256] = {};
+        for (const auto& e : a){
+            count[(e.first >> shift) & 0xff]++;
+        }
+        if (count[(a[0].first >> shift) & 0xff] == n){
+            continue;
+        }
+        size_t pos = 0;
+        for (auto& c : count){
+            size_t bucket = c;
+            c = pos;
+            pos += bucket;
+        }
+        for (const auto& e : a){
+            b[count[(e.first >> shift) & 0xff]++] = e;
+        }
+        std::swap(a, b);
+    }
+    for (size_t k = 0; k < n; k++){
+        v[k] = a[k].second;
+    }
+}
+
+// std::sort of one slice per worker, then slices merged pairwise with
+// the merges of a round running side by side
+template<typename T, typename Less>
+static inline void parallelSort(std::vector<T>& v, Less less){
+    // below this a thread hop costs more than it saves
+    static constexpr size_t MIN_PARALLEL = 1 << 16;
+    size_t n = v.size();
+    size_t parts = workerCount();
+    if (n < MIN_PARALLEL || parts < 2){
+        std::sort(v.begin(), v.end(), less);
+        return;
+    }
+    std::vector<size_t> bounds;
+    for (size_t k = 0; k < parts; k++){
+        bounds.push_back(n * k / parts);
+    }
+    bounds.push_back(n);
+
+    auto at = [&](size_t pos){ return v.begin() + pos; };
+    parallelFor(parts, [&](size_t k){
+        std::sort(at(bounds[k]), at(bounds[k + 1]), less);
+    });
+    while (bounds.size() > 2){
+        parallelFor((bounds.size() - 1) / 2, [&](size_t k){
+            std::inplace_merge(at(bounds[2 * k]), at(bounds[2 * k + 1]),
+                at(bounds[2 * k + 2]), less);
+        });
+        std::vector<size_t> merged;
+        for (size_t k = 0; k + 1 < bounds.size(); k += 2){
+            merged.push_back(bounds[k]);
+        }
+        merged.push_back(n);
+        bounds = std::move(merged);
+    }
+}
+
+// sort orders of an EntryTable
+// keys (collation, natural, extension) are computed once per entry as
+// entries are added, and the order of the whole table is kept for every
+// sort order once it was used. Switching to an order seen before only
+// picks the listed entries out of its cached order. Orders by a number
+// are radix sorted on top of the name order, which breaks their ties.
+// clear() must be called whenever the table is cleared or replaced.
+class Sorter{
+    public:
+    enum Order{
+        NAME_A = 0,
+        NAME_D,
+        NATURAL,
+        EXTENSION,
+        SIZE_A,
+        SIZE_D,
+        TIME_D,
+        TIME_A,
+        TYPE,
+        NONE,
+    };
+
+    private:
+    // LC_COLLATE is not byte order, names compare by strxfrm keys
+    bool collate = false;
+    KeyArena collateKeys;
+    // prefixOf the name as shown, or of its collation key
+    std::vector<uint64_t> prefix;
+    KeyArena naturalKeys;
+    // where the extension starts in name(i), the name length if none
+    std::vector<uint8_t> extension;
+    // the whole table in each order, valid while the table has
+    // orderedSize[o] entries
+    std::vector<size_t> orders[NONE];
+    size_t orderedSize[NONE];
+
+    static bool collating(){
+        const char* locale = setlocale(LC_COLLATE, NULL);
+        return locale && strcmp(locale, "C") && strcmp(locale, "POSIX") &&
+            strncmp(locale, "C.", 2);
+    }
+
+    static std::string_view shownName(EntryTable& files, size_t i,
+        std::string& buf)
+    {
+        if (files.relativeDir(i).empty()){
+            return files.name(i);
+        }
+        buf = files.displayName(i);
+        return buf;
+    }
+
+    // extend keys to every entry of files, a slice per worker when
+    // there are many new entries
+    template<typename MakeKey>
+    static void fill(EntryTable& files, KeyArena& keys, MakeKey makeKey){
+        size_t first = keys.size();
+        size_t n = files.size() - first;
+        size_t parts = n < (1 << 14) ? 1 : workerCount();
+        std::vector<std::string> bufs(parts);
+        std::vector<std::vector<uint32_t>> ends(parts);
+        auto work = [&](size_t k){
+            std::string name;
+            for (size_t i = first + n * k / parts;
+                i < first + n * (k + 1) / parts; i++)
+            {
+                makeKey(shownName(files, i, name), bufs[k]);
+                ends[k].push_back(bufs[k].size());
+            }
+        };
+        if (parts == 1){
+            work(0);
+        }else{
+            parallelFor(parts, work);
+        }
+        for (size_t k = 0; k < parts; k++){
+            keys.append(bufs[k], ends[k]);
+        }
+    }
+
+    std::string_view ext(EntryTable& files, size_t i){
+        return files.name(i).substr(extension[i]);
+    }
+
+    // directories, then symlinks, then everything else
+    static int typeRank(File::Type type){
+        return type == File::DIR ? 0 : type == File::SYM ? 1 : 2;
+    }
+
+    // numeric key of i in order o for the radix sort
+    uint64_t key(EntryTable& files, Order o, size_t i){
+        // flip the sign bit so negative times sort first
+        uint64_t time = (uint64_t)files.mtime(i) ^ (1ull << 63);
+        switch (o){
+            case SIZE_A: return files.fileSize(i);
+            case SIZE_D: return ~(uint64_t)files.fileSize(i);
+            case TIME_D: return ~time;
+            case TIME_A: return time;
+            case TYPE:   return typeRank(files.type(i));
+            default:     return 0;
+        }
+    }
+
+    // prefixOf the key of i that order o compares first
+    uint64_t prefixKey(EntryTable& files, Order o, size_t i){
+        switch (o){
+            case NATURAL:   return prefixOf(naturalKeys.get(i));
+            case EXTENSION: return prefixOf(ext(files, i));
+            default:        return prefix[i];
+        }
+    }
+
+    static Order normal(Order o){
+        return o == NONE ? NAME_A : o;
+    }
+
+    public:
+    Sorter(){
+        clear();
+    }
+
+    void clear(){
+        collate = collating();
+        collateKeys.clear();
+        prefix.clear();
+        naturalKeys.clear();
+        extension.clear();
+        std::fill(std::begin(orderedSize), std::end(orderedSize), SIZE_MAX);
+    }
+
+    // order o depends on sizes or times
+    static bool byStat(Order o){
+        return o == SIZE_A || o == SIZE_D || o == TIME_D || o == TIME_A;
+    }
+
+    // sizes or times of entries changed, orders by them are out of date
+    void changed(){
+        for (int o = 0; o < NONE; o++){
+            if (byStat(Order(o))){
+                orderedSize[o] = SIZE_MAX;
+            }
+        }
+    }
+
+    // compute the keys order o needs for entries added since last time
+    // must be called before less() sees new entries
+    void prepare(EntryTable& files, Order o){
+        o = normal(o);
+        if (collate){
+            fill(files, collateKeys, collationKey);
+        }
+        std::string name;
+        for (size_t i = prefix.size(); i < files.size(); i++){
+            prefix.push_back(prefixOf(collate ?
+                collateKeys.get(i) : shownName(files, i, name)));
+        }
+        if (o == NATURAL){
+            fill(files, naturalKeys, naturalKey);
+        }
+        if (o == EXTENSION){
+            for (size_t i = extension.size(); i < files.size(); i++){
+                auto name = files.name(i);
+                auto dot = name.rfind('.');
+                // a leading dot starts a hidden name, not an extension
+                extension.push_back(dot == std::string_view::npos ||
+                    dot == 0 ? name.length() : dot + 1);
+            }
+        }
+    }
+
+    // compare names as shown, relative directory included
+    int compareName(EntryTable& files, size_t l, size_t r){
+        // names have no NUL, a shorter name is padded below any byte
+        if (prefix[l] != prefix[r]){
+            return prefix[l] < prefix[r] ? -1 : 1;
+        }
+        if (collate){
+            int c = collateKeys.get(l).compare(collateKeys.get(r));
+            if (c){
+                return c;
+            }
+        }
+        auto ldir = files.relativeDir(l);
+        auto rdir = files.relativeDir(r);
+        if (ldir.data() == rdir.data()){
+            return files.name(l).compare(files.name(r));
+        }
+        return compareJoined(ldir, files.name(l), rdir, files.name(r));
+    }
+
+    // compare a1 + a2 with b1 + b2 the way std::string would
+    static int compareJoined(
+        std::string_view a1, std::string_view a2,
+        std::string_view b1, std::string_view b2)
+    {
+        size_t na = a1.length() + a2.length();
+        size_t nb = b1.length() + b2.length();
+        for (size_t k = 0; k < na && k < nb; k++){
+            unsigned char ca = k < a1.length() ? a1[k] : a2[k - a1.length()];
+            unsigned char cb = k < b1.length() ? b1[k] : b2[k - b1.length()];
+            if (ca != cb){
+                return ca < cb ? -1 : 1;
+            }
+        }
+        return na < nb ? -1 : na > nb;
+    }
+
+    // l goes before r in order o, ties are broken by name
+    bool less(EntryTable& files, Order o, size_t l, size_t r){
+        int c = 0;
+        switch (normal(o)){
+            case NAME_D:
+                return compareName(files, l, r) > 0;
+            case NATURAL:
+                c = naturalKeys.get(l).compare(naturalKeys.get(r));
+                break;
+            case EXTENSION:
+                c = ext(files, l).compare(ext(files, r));
+                break;
+            case SIZE_A: case SIZE_D: case TIME_D: case TIME_A: case TYPE:{
+                uint64_t lk = key(files, o, l);
+                uint64_t rk = key(files, o, r);
+                c = lk < rk ? -1 : lk > rk;
+                break;
+            }
+            default:
+                break;
+        }
+        if (c){
+            return c < 0;
+        }
+        return compareName(files, l, r) < 0;
+    }
+
+    // the order of o is cached for the current table
+    bool cached(EntryTable& files, Order o){
+        return orderedSize[normal(o)] == files.size();
+    }
+
+    // every entry of files in order o, removed ones may be left out
+    const std::vector<size_t>& order(EntryTable& files, Order o){
+        o = normal(o);
+        if (cached(files, o)){
+            return orders[o];
+        }
+        prepare(files, o);
+        auto& v = orders[o];
+        switch (o){
+            case NAME_D:
+                v = order(files, NAME_A);
+                std::reverse(v.begin(), v.end());
+                break;
+            case SIZE_A: case SIZE_D: case TIME_D: case TIME_A: case TYPE:
+                v = order(files, NAME_A);
+                radixSort(v, [&](size_t i){ return key(files, o, i); });
+                break;
+            default:{
+                // the prefixes sit next to the indices, so most
+                // comparisons do not touch the names or keys at all
+                std::vector<std::pair<uint64_t, size_t>> keyed(files.size());
+                for (size_t i = 0; i < files.size(); i++){
+                    keyed[i] = { prefixKey(files, o, i), i };
+                }
+                parallelSort(keyed, [&](const auto& l, const auto& r){
+                    if (l.first != r.first){
+                        return l.first < r.first;
+                    }
+                    return less(files, o, l.second, r.second);
+                });
+                v.resize(files.size());
+                for (size_t i = 0; i < files.size(); i++){
+                    v[i] = keyed[i].second;
+                }
+            }
+        }
+        orderedSize[o] = files.size();
+        return v;
+    }
+
+    // v holds every entry of files that is not removed, already in
+    // order o; keep it as the cached order
+    void seed(EntryTable& files, Order o, const std::vector<size_t>& v){
+        o = normal(o);
+        if (!cached(files, o)){
+            orders[o] = v;
+            orderedSize[o] = files.size();
+        }
+    }
+
+    // sort v, a subset of files, by o
+    void sort(EntryTable& files, Order o, std::vector<size_t>& v){
+        prepare(files, o);
+        parallelSort(v, [&](size_t l, size_t r){
+            return less(files, o, l, r);
+        });
+    }
+
+    // put v, a subset of files, in order o by picking its entries out of
+    // the cached order; linear in the size of files once cached
+    void select(EntryTable& files, Order o, std::vector<size_t>& v){
+        const auto& all = order(files, o);
+        std::vector<bool> listed(files.size());
+        for (auto i : v){
+            listed[i] = true;
+        }
+        v.clear();
+        for (auto i : all){
+            if (listed[i]){
+                v.push_back(i);
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,438 @@
+#ifndef _STATX_HPP_
+#define _STATX_HPP_
+
+#include "config.hpp"
+#include "log.hpp"
+#include "pool.hpp"
+
+// the part of struct stat File Explorer cares about
+struct Stat{
+    // fields a caller needs, lets statx skip the rest
+    enum Field{
+        TYPE = 1,
+        SIZE = 2,
+        TIME = 4,
+        ALL = TYPE | SIZE | TIME,
+        // allocated size and identity, for disk usage
+        USAGE = 8,
+    };
+
+    int error = 0;
+    mode_t mode = 0;
+    off_t size = 0;
+    // modification time
+    struct timespec mtime = {0, 0};
+    // bytes allocated on disk, st_blocks in bytes
+    off_t usage = 0;
+    dev_t dev = 0;
+    ino_t ino = 0;
+    nlink_t nlink = 0;
+};
+
+// synchronous lstat relative to dirfd
+static inline Stat statAt(int dirfd, const char* name){
+    Stat st;
+    struct stat filestat;
+    if (fstatat(dirfd, name, &filestat, AT_SYMLINK_NOFOLLOW) == -1){
+        st.error = errno;
+        return st;
+    }
+    st.mode = filestat.st_mode;
+    st.size = filestat.st_size;
+    st.usage = (off_t)filestat.st_blocks * 512;
+    st.dev = filestat.st_dev;
+    st.ino = filestat.st_ino;
+    st.nlink = filestat.st_nlink;
+#ifdef __APPLE__
+    st.mtime = filestat.st_mtimespec;
+#else
+    st.mtime = filestat.st_mtim;
+#endif
+    return st;
+}
+
+#ifdef __linux__
+// minimal io_uring wrapper
+// only what is needed to push statx requests and reap completions
+class Uring{
+    int fd = -1;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t sqesSize = 0;
+
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqArray;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes;
+
+    // sqes written but not yet made visible to the kernel
+    unsigned pending = 0;
+
+    template<typename T>
+    static T* at(void* base, size_t offset){
+        return (T*)((char*)base + offset);
+    }
+
+    public:
+    Uring(unsigned entries){
+        io_uring_params p{};
+        fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (fd < 0){
+            return;
+        }
+
+        sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single){
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+
+        sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED){
+            close();
+            return;
+        }
+        cqRing = single ? sqRing : mmap(NULL, cqRingSize,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED){
+            close();
+            return;
+        }
+        sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(NULL, sqesSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED){
+            close();
+            return;
+        }
+
+        sqHead = at<unsigned>(sqRing, p.sq_off.head);
+        sqTail = at<unsigned>(sqRing, p.sq_off.tail);
+        sqArray = at<unsigned>(sqRing, p.sq_off.array);
+        sqMask = *at<unsigned>(sqRing, p.sq_off.ring_mask);
+        sqEntries = p.sq_entries;
+        cqHead = at<unsigned>(cqRing, p.cq_off.head);
+        cqTail = at<unsigned>(cqRing, p.cq_off.tail);
+        cqMask = *at<unsigned>(cqRing, p.cq_off.ring_mask);
+        cqes = at<io_uring_cqe>(cqRing, p.cq_off.cqes);
+    }
+
+    ~Uring(){
+        close();
+    }
+
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+
+    void close(){
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+        sqes = (io_uring_sqe*)MAP_FAILED;
+        sqRing = cqRing = MAP_FAILED;
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    }
+
+    bool ok(){
+        return fd >= 0;
+    }
+
+    unsigned capacity(){
+        return sqEntries;
+    }
+
+    // sqes the kernel has taken so far; each one gets a completion
+    unsigned consumed(){
+        return __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    }
+
+    // next free sqe, or NULL if the submission queue is full
+    io_uring_sqe* sqe(){
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        unsigned tail = *sqTail + pending;
+        if (tail - head >= sqEntries){
+            return NULL;
+        }
+        unsigned idx = tail & sqMask;
+        sqArray[idx] = idx;
+        pending++;
+        memset(&sqes[idx], 0, sizeof(io_uring_sqe));
+        return &sqes[idx];
+    }
+
+    // submit pending sqes and wait for at least `wait` completions
+    int submit(unsigned wait){
+        unsigned n = pending;
+        __atomic_store_n(sqTail, *sqTail + n, __ATOMIC_RELEASE);
+        pending = 0;
+        int ret;
+        do {
+            ret = syscall(__NR_io_uring_enter, fd, n, wait,
+                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        }while(ret == -1 && errno == EINTR);
+        return ret;
+    }
+
+    // call onCqe on every available completion
+    template<typename OnCqe>
+    unsigned reap(OnCqe onCqe){
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        unsigned n = tail - head;
+        for (; head != tail; head++){
+            onCqe(cqes[head & cqMask]);
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        return n;
+    }
+};
+#endif
+
+// batched lstat of many entries
+// requests are added relative to an open directory fd, then run() calls
+// onDone(index, stat) as results complete, not necessarily in order.
+// uses io_uring statx on linux and falls back to the worker pool
+class StatBatch{
+    struct Request{
+        int dirfd;
+        std::string name;
+        unsigned fields;
+    };
+    std::vector<Request> requests;
+
+    // batches smaller than this are not worth a ring or a thread hop
+    static constexpr size_t MIN_BATCH = 32;
+
+    // io_uring_setup is refused in some sandboxes; stop retrying after that
+    static std::atomic<bool>& uringDisabled(){
+        static std::atomic<bool> disabled = false;
+        return disabled;
+    }
+
+#ifdef __linux__
+    // one ring per thread, set up by its first batch and reused after that
+    static std::unique_ptr<Uring>& threadRing(){
+        thread_local std::unique_ptr<Uring> ring;
+        return ring;
+    }
+#endif
+
+    template<typename OnDone>
+    void runSync(OnDone& onDone){
+        for (size_t i = 0; i < requests.size(); i++){
+            const auto& r = requests[i];
+            onDone(i, statAt(r.dirfd, r.name.c_str()));
+        }
+    }
+
+#ifdef __linux__
+    static unsigned statxMask(unsigned fields){
+        unsigned mask = 0;
+        if (fields & Stat::TYPE) mask |= STATX_TYPE;
+        if (fields & Stat::SIZE) mask |= STATX_SIZE;
+        if (fields & Stat::TIME) mask |= STATX_MTIME;
+        if (fields & Stat::USAGE){
+            mask |= STATX_BLOCKS | STATX_INO | STATX_NLINK;
+        }
+        return mask;
+    }
+
+    template<typename OnDone>
+    bool runUring(OnDone& onDone){
+        if (uringDisabled()){
+            return false;
+        }
+        auto& uring = threadRing();
+        if (!uring){
+            uring = std::make_unique<Uring>(STAT_BATCH_SIZE);
+            if (!uring->ok()){
+                FElog.add(std::string("io_uring unavailable: ") +
+                    strerror(errno));
+                uringDisabled() = true;
+                uring.reset();
+                return false;
+            }
+        }
+        Uring& ring = *uring;
+
+        // statx buffers must stay alive until the completion is reaped
+        // so a fixed set of slots is recycled instead of one per request
+        std::vector<struct statx> bufs(ring.capacity());
+        std::vector<size_t> slotIndex(ring.capacity());
+        std::vector<unsigned> freeSlots;
+        for (unsigned i = 0; i < ring.capacity(); i++){
+            freeSlots.push_back(i);
+        }
+
+        auto onCqe = [&](const io_uring_cqe& cqe){
+            unsigned slot = cqe.user_data;
+            size_t index = slotIndex[slot];
+            freeSlots.push_back(slot);
+
+            Stat st;
+            if (cqe.res < 0){
+                // redo failures synchronously: kernels without
+                // IORING_OP_STATX answer -EINVAL, and real errors
+                // such as ENOENT come back the same either way
+                const auto& r = requests[index];
+                st = statAt(r.dirfd, r.name.c_str());
+            }else{
+                st.mode = bufs[slot].stx_mode;
+                st.size = bufs[slot].stx_size;
+                st.mtime.tv_sec = bufs[slot].stx_mtime.tv_sec;
+                st.mtime.tv_nsec = bufs[slot].stx_mtime.tv_nsec;
+                st.usage = (off_t)bufs[slot].stx_blocks * 512;
+                st.dev = makedev(bufs[slot].stx_dev_major,
+                    bufs[slot].stx_dev_minor);
+                st.ino = bufs[slot].stx_ino;
+                st.nlink = bufs[slot].stx_nlink;
+            }
+            onDone(index, st);
+        };
+
+        // requests go in in order, so the ones the kernel took are the
+        // first consumed() - first of them
+        unsigned first = ring.consumed();
+        size_t next = 0;
+        size_t done = 0;
+        while (done < requests.size()){
+            while (next < requests.size() && freeSlots.size()){
+                auto sqe = ring.sqe();
+                if (!sqe){
+                    break;
+                }
+                unsigned slot = freeSlots.back();
+                freeSlots.pop_back();
+                slotIndex[slot] = next;
+
+                const auto& r = requests[next];
+                sqe->opcode = IORING_OP_STATX;
+                sqe->fd = r.dirfd;
+                sqe->addr = (uint64_t)r.name.c_str();
+                sqe->len = statxMask(r.fields);
+                sqe->off = (uint64_t)&bufs[slot];
+                sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+                sqe->user_data = slot;
+                next++;
+            }
+
+            if (ring.submit(1) < 0){
+                // ring broke mid batch; finish what is left synchronously
+                // batches run on background threads, so only log it
+                FElog.add(std::string("io_uring_enter: ") + strerror(errno));
+                uringDisabled() = true;
+                // the kernel still writes into bufs for what it took, so
+                // wait for those; the rest was never submitted
+                size_t submitted = (unsigned)(ring.consumed() - first);
+                while (done < submitted){
+                    unsigned n = ring.reap(onCqe);
+                    if (!n){
+                        std::this_thread::sleep_for(
+                            std::chrono::milliseconds(1));
+                    }
+                    done += n;
+                }
+                uring.reset();
+                for (size_t i = submitted; i < requests.size(); i++){
+                    const auto& r = requests[i];
+                    onDone(i, statAt(r.dirfd, r.name.c_str()));
+                }
+                return true;
+            }
+
+            done += ring.reap(onCqe);
+        }
+        return true;
+    }
+#endif
+
+    template<typename OnDone>
+    void runPool(OnDone& onDone){
+        auto& pool = workers();
+        size_t n = requests.size();
+        size_t chunk = std::max(MIN_BATCH, n / (pool.size() * 4) + 1);
+
+        // workers stat a chunk each; results are handed back to the
+        // calling thread chunk by chunk so onDone never runs concurrently
+        std::vector<Stat> results(n);
+        std::deque<std::pair<size_t, size_t>> finished;
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t chunks = 0;
+        for (size_t begin = 0; begin < n; begin += chunk, chunks++){
+            size_t end = std::min(n, begin + chunk);
+            pool.submit([&, begin, end](){
+                for (size_t i = begin; i < end; i++){
+                    const auto& r = requests[i];
+                    results[i] = statAt(r.dirfd, r.name.c_str());
+                }
+                std::lock_guard lock(mutex);
+                finished.push_back({begin, end});
+                cv.notify_one();
+            });
+        }
+
+        for (size_t c = 0; c < chunks; c++){
+            std::pair<size_t, size_t> range;
+            {
+                std::unique_lock lock(mutex);
+                cv.wait(lock, [&](){ return finished.size(); });
+                range = finished.front();
+                finished.pop_front();
+            }
+            for (size_t i = range.first; i < range.second; i++){
+                onDone(i, results[i]);
+            }
+        }
+    }
+
+    public:
+    // name must be relative to dirfd, or absolute
+    // dirfd must stay open until run() returns
+    size_t add(int dirfd, const std::string& name,
+        unsigned fields = Stat::ALL)
+    {
+        requests.push_back({dirfd, name, fields});
+        return requests.size() - 1;
+    }
+
+    const std::string& name(size_t index){
+        return requests[index].name;
+    }
+
+    size_t size(){
+        return requests.size();
+    }
+
+    void clear(){
+        requests.clear();
+    }
+
+    template<typename OnDone>
+    void run(OnDone onDone){
+        if (requests.size() < MIN_BATCH){
+            runSync(onDone);
+            return;
+        }
+#ifdef __linux__
+        if (runUring(onDone)){
+            return;
+        }
+#endif
+        runPool(onDone);
+    }
+};
+
+#endif
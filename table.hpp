@@ -0,0 +1,369 @@
+#ifndef _TABLE_HPP_
+#define _TABLE_HPP_
+
+#include "file.hpp"
+#include "simd.hpp"
+#include "query.hpp"
+
+static inline int64_t nanoseconds(const struct timespec& t){
+    return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// deduplicated strings referred to by index
+// index 0 is always the empty string
+class Intern{
+    // deque so that views into stored strings stay valid when it grows
+    std::deque<std::string> strings = { "" };
+    std::unordered_map<std::string_view, uint32_t> lookup = { { "", 0 } };
+
+    public:
+    uint32_t add(const std::string& str){
+        auto found = lookup.find(str);
+        if (found != lookup.end()){
+            return found->second;
+        }
+        strings.push_back(str);
+        uint32_t index = strings.size() - 1;
+        lookup.emplace(strings.back(), index);
+        return index;
+    }
+
+    const std::string& get(uint32_t index){
+        return strings[index];
+    }
+
+    size_t size(){
+        return strings.size();
+    }
+
+    // rough estimate of heap memory used
+    size_t memory(){
+        size_t bytes = 0;
+        for (auto& s : strings){
+            bytes += sizeof(std::string) + s.capacity() +
+                sizeof(std::string_view) + sizeof(uint32_t);
+        }
+        return bytes;
+    }
+};
+
+// struct-of-arrays storage of directory entries
+// names live back to back in one arena, parent directories are stored
+// once and referred to by index, libmagic descriptions go through an
+// Intern. An entry costs a few fixed size columns plus its name bytes.
+class EntryTable{
+    // NUL terminated names back to back
+    std::vector<char> names;
+    std::vector<uint32_t> nameOffset;
+    std::vector<uint32_t> dirIndex;
+    std::vector<off_t> sizes;
+    // modification time in nanoseconds
+    std::vector<int64_t> mtimes;
+    std::vector<uint32_t> magicIndex;
+    // TYPE_MASK bits hold File::Type, the rest are flags below
+    std::vector<uint8_t> flags;
+    // charMask of each name and of each dir relative to base
+    std::vector<uint64_t> masks;
+    std::vector<uint64_t> dirMasks;
+
+    // full paths of parent directories, ending with '/'
+    std::vector<std::string> dirs;
+    // all dirs start with base, names are shown relative to it
+    std::string base;
+    // symlink targets, few enough to keep out of the columns
+    std::unordered_map<uint32_t, std::string> syms;
+    Intern magics;
+    // hash of name to entries, only built once find() is first used
+    std::unordered_multimap<size_t, uint32_t> nameIndex;
+    bool indexed = false;
+    // different for every clear(), tells tables apart for caches of
+    // their entries
+    uint64_t gen = 0;
+
+    static const uint8_t TYPE_MASK = 0x7;
+    static const uint8_t CLASSIFIED = 0x10;
+    static const uint8_t REMOVED = 0x20;
+
+    static size_t hash(size_t dir, std::string_view name){
+        return std::hash<std::string_view>()(name) ^ (dir * 0x9e3779b97f4a7c15);
+    }
+
+    public:
+    // drop all entries, following dirs are added under base
+    void clear(const std::string& base){
+        names.clear();
+        nameOffset.clear();
+        dirIndex.clear();
+        sizes.clear();
+        mtimes.clear();
+        magicIndex.clear();
+        flags.clear();
+        masks.clear();
+        dirMasks.clear();
+        dirs.clear();
+        syms.clear();
+        magics = Intern();
+        nameIndex.clear();
+        indexed = false;
+        static uint64_t generations = 0;
+        gen = ++generations;
+        this->base = joinPath(base, "");
+    }
+
+    uint64_t generation(){
+        return gen;
+    }
+
+    // register a parent directory, returns the index to pass to add()
+    size_t addDir(const std::string& path){
+        dirs.push_back(joinPath(path, ""));
+        dirMasks.push_back(::charMask(
+            std::string_view(dirs.back()).substr(base.length())));
+        return dirs.size() - 1;
+    }
+
+    // dirfd must be the open parent directory, used to read symlinks
+    // pass -1 to leave the symlink target to setSym()
+    size_t add(size_t dir, std::string_view name,
+        const Stat& filestat, int dirfd)
+    {
+        size_t i = nameOffset.size();
+        nameOffset.push_back(names.size());
+        names.insert(names.end(), name.begin(), name.end());
+        names.push_back(0);
+        dirIndex.push_back(dir);
+        sizes.push_back(filestat.size);
+        mtimes.push_back(nanoseconds(filestat.mtime));
+        magicIndex.push_back(0);
+        masks.push_back(::charMask(name));
+
+        auto type = File::typeOf(filestat.mode);
+        flags.push_back(type);
+        if (filestat.error){
+            exitError(path(i), strerror(filestat.error));
+        }
+        if (type == File::SYM && dirfd != -1){
+            syms[i] = File::resolveSymLink(dirfd, this->name(i).data());
+        }
+        if (indexed){
+            nameIndex.emplace(hash(dir, name), i);
+        }
+        return i;
+    }
+
+    // entry called name in dir, -1 if there is none
+    long find(size_t dir, std::string_view name){
+        if (!indexed){
+            for (size_t i = 0; i < size(); i++){
+                nameIndex.emplace(hash(dirIndex[i], this->name(i)), i);
+            }
+            indexed = true;
+        }
+        auto [begin, end] = nameIndex.equal_range(hash(dir, name));
+        for (auto it = begin; it != end; it++){
+            size_t i = it->second;
+            if (!removed(i) && dirIndex[i] == dir && this->name(i) == name){
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // append entries whose name contains needle to out, in index order
+    // one pass of the vectorised search over the name arena; with fold
+    // set needle must be lower case and ASCII case is ignored
+    void findName(std::string_view needle, bool fold,
+        std::vector<size_t>& out)
+    {
+        std::vector<uint32_t> hits;
+        findInNames(names.data(), names.size(), needle, fold, hits);
+        // hits are in arena order, so are the entries they fall in
+        size_t i = 0;
+        for (auto hit : hits){
+            while (i + 1 < nameOffset.size() && nameOffset[i + 1] <= hit){
+                i++;
+            }
+            if (!removed(i)){
+                out.push_back(i);
+            }
+        }
+    }
+
+    // charMask of displayName(i)
+    uint64_t charMask(size_t i){
+        return masks[i] | dirMasks[dirIndex[i]];
+    }
+
+    // all entries are directly in base, so displayName() is name()
+    bool flat(){
+        for (const auto& d : dirs){
+            if (d != base){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // entries are never erased, only marked so indices stay valid
+    void remove(size_t i){
+        flags[i] |= REMOVED;
+    }
+
+    bool removed(size_t i){
+        return flags[i] & REMOVED;
+    }
+
+    void setSize(size_t i, off_t size){
+        sizes[i] = size;
+    }
+
+    void setTime(size_t i, const struct timespec& mtime){
+        mtimes[i] = nanoseconds(mtime);
+    }
+
+    // let libmagic look at the entry again, old type is kept until then
+    void unclassify(size_t i){
+        flags[i] &= ~CLASSIFIED;
+    }
+
+    size_t size(){
+        return nameOffset.size();
+    }
+
+    // rough estimate of heap memory used
+    size_t memory(){
+        size_t bytes = names.capacity() +
+            nameOffset.capacity() * sizeof(uint32_t) +
+            dirIndex.capacity() * sizeof(uint32_t) +
+            sizes.capacity() * sizeof(off_t) +
+            mtimes.capacity() * sizeof(int64_t) +
+            magicIndex.capacity() * sizeof(uint32_t) +
+            flags.capacity() * sizeof(uint8_t) +
+            masks.capacity() * sizeof(uint64_t) +
+            dirMasks.capacity() * sizeof(uint64_t) +
+            base.capacity() + magics.memory() +
+            nameIndex.size() * (sizeof(size_t) + sizeof(uint32_t) + 16);
+        for (auto& d : dirs){
+            bytes += sizeof(std::string) + d.capacity();
+        }
+        for (auto& [i, s] : syms){
+            bytes += sizeof(i) + sizeof(std::string) + s.capacity();
+        }
+        return bytes;
+    }
+
+    // NUL terminated
+    std::string_view name(size_t i){
+        size_t begin = nameOffset[i];
+        size_t end = i + 1 < nameOffset.size() ?
+            nameOffset[i + 1] : names.size();
+        return std::string_view(&names[begin], end - begin - 1);
+    }
+
+    const std::string& dir(size_t i){
+        return dirs[dirIndex[i]];
+    }
+
+    // parent directory relative to base, empty or ending with '/'
+    std::string_view relativeDir(size_t i){
+        return std::string_view(dir(i)).substr(base.length());
+    }
+
+    std::string path(size_t i){
+        return dir(i) + std::string(name(i));
+    }
+
+    // name as shown in the list, relative to base
+    std::string displayName(size_t i){
+        return std::string(relativeDir(i)) + std::string(name(i));
+    }
+
+    File::Type type(size_t i){
+        return File::Type(flags[i] & TYPE_MASK);
+    }
+
+    off_t fileSize(size_t i){
+        return sizes[i];
+    }
+
+    int64_t mtime(size_t i){
+        return mtimes[i];
+    }
+
+    const std::string& sym(size_t i){
+        static const std::string none;
+        auto found = syms.find(i);
+        return found == syms.end() ? none : found->second;
+    }
+
+    void setSym(size_t i, const std::string& target){
+        syms[i] = target;
+    }
+
+    bool classified(size_t i){
+        return flags[i] & CLASSIFIED;
+    }
+
+    const std::string& magic(size_t i){
+        return magics.get(magicIndex[i]);
+    }
+
+    void setMagic(size_t i, const std::string& magic){
+        magicIndex[i] = magics.add(magic);
+        auto type = File::typeOf(this->type(i), magic);
+        flags[i] = (flags[i] & ~TYPE_MASK) | type | CLASSIFIED;
+    }
+
+    // copy of entry i for operations that need a standalone File
+    File file(size_t i){
+        File f;
+        f.fullpath = path(i);
+        f.name = displayName(i);
+        f.type = type(i);
+        f.sym = sym(i);
+        f.size = fileSize(i);
+        f.magic = magic(i);
+        f.classified = classified(i);
+        return f;
+    }
+};
+
+// entry i of an EntryTable without copying it
+// valid as long as the table is not cleared or replaced
+class EntryRef{
+    EntryTable* files;
+    size_t i;
+
+    public:
+    EntryRef(EntryTable& files, size_t i): files(&files), i(i) {}
+
+    size_t index() const {
+        return i;
+    }
+
+    std::string_view name() const {
+        return files->name(i);
+    }
+
+    std::string_view relativeDir() const {
+        return files->relativeDir(i);
+    }
+
+    std::string displayName() const {
+        return files->displayName(i);
+    }
+
+    File::Type type() const {
+        return files->type(i);
+    }
+
+    const std::string& sym() const {
+        return files->sym(i);
+    }
+
+    off_t size() const {
+        return files->fileSize(i);
+    }
+};
+
+#endif
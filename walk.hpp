@@ -0,0 +1,354 @@
+#ifndef _WALK_HPP_
+#define _WALK_HPP_
+
+#include "config.hpp"
+#include "log.hpp"
+#include "pool.hpp"
+#include "scan.hpp"
+#include "query.hpp"
+
+// items of a parallel walk, usually directories, on several threads
+// every thread keeps its own deque of items. It takes work from the back
+// of its own deque and, once that runs dry, steals from the front of
+// another thread's, so big subtrees spread over idle threads without a
+// shared queue everyone contends on.
+template<typename Item>
+class WorkStealing{
+    struct Queue{
+        std::mutex mutex;
+        std::deque<Item> items;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::function<void(size_t, Item&)> visit;
+    // items queued or being visited; the walk is over at zero
+    std::atomic<size_t> pending = 0;
+    // items queued and not yet taken by a thread
+    std::atomic<size_t> queued = 0;
+    std::mutex idleMutex;
+    std::condition_variable idle;
+    std::atomic<bool> cancelled = false;
+    // threads still walking, finished once it drops to zero
+    std::atomic<size_t> running = 0;
+    std::atomic<bool> finished = false;
+    std::mutex doneMutex;
+    std::condition_variable doneCv;
+
+    // newest item of thread w, depth first keeps its deque short
+    bool pop(size_t w, Item& item){
+        std::lock_guard lock(queues[w]->mutex);
+        if (!queues[w]->items.size()){
+            return false;
+        }
+        item = std::move(queues[w]->items.back());
+        queues[w]->items.pop_back();
+        queued--;
+        return true;
+    }
+
+    // oldest item of some other thread, it is likely the biggest
+    bool steal(size_t w, Item& item){
+        for (size_t k = 1; k < queues.size(); k++){
+            auto& victim = *queues[(w + k) % queues.size()];
+            std::lock_guard lock(victim.mutex);
+            if (victim.items.size()){
+                item = std::move(victim.items.front());
+                victim.items.pop_front();
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(size_t w){
+        Item item;
+        while (!cancelled){
+            if (pop(w, item) || steal(w, item)){
+                visit(w, item);
+                if (--pending == 0){
+                    std::lock_guard lock(idleMutex);
+                    idle.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock lock(idleMutex);
+            idle.wait(lock, [&](){
+                return queued || !pending || cancelled;
+            });
+            if (!pending){
+                break;
+            }
+        }
+        if (--running == 0){
+            std::lock_guard lock(doneMutex);
+            finished = true;
+            doneCv.notify_all();
+        }
+    }
+
+    public:
+    WorkStealing() = default;
+
+    ~WorkStealing(){
+        cancel();
+        for (auto& t : threads){
+            t.join();
+        }
+    }
+
+    WorkStealing(const WorkStealing&) = delete;
+    WorkStealing& operator=(const WorkStealing&) = delete;
+
+    // call visit(w, item) on thread w for roots and every item pushed
+    // while visiting, on n threads; done at once without roots
+    void start(size_t n, std::vector<Item> roots,
+        std::function<void(size_t, Item&)> visit)
+    {
+        if (!roots.size()){
+            finished = true;
+            return;
+        }
+        this->visit = std::move(visit);
+        n = std::max<size_t>(n, 1);
+        for (size_t i = 0; i < n; i++){
+            queues.push_back(std::make_unique<Queue>());
+        }
+        push(0, roots);
+        running = n;
+        for (size_t i = 0; i < n; i++){
+            threads.emplace_back([this, i](){ work(i); });
+        }
+    }
+
+    // queue items on thread w, items is left empty
+    void push(size_t w, std::vector<Item>& items){
+        if (!items.size()){
+            return;
+        }
+        pending += items.size();
+        {
+            std::lock_guard lock(queues[w]->mutex);
+            queued += items.size();
+            for (auto& item : items){
+                queues[w]->items.push_back(std::move(item));
+            }
+        }
+        items.clear();
+        std::lock_guard lock(idleMutex);
+        idle.notify_all();
+    }
+
+    // stop after the items being visited
+    void cancel(){
+        cancelled = true;
+        std::lock_guard lock(idleMutex);
+        idle.notify_all();
+    }
+
+    bool cancelling(){
+        return cancelled;
+    }
+
+    // wait up to ms milliseconds for the walk to finish
+    bool wait(int ms){
+        std::unique_lock lock(doneMutex);
+        return doneCv.wait_for(lock, std::chrono::milliseconds(ms),
+            [&](){ return (bool)finished; });
+    }
+
+    // every item is visited, or the walk was cancelled
+    bool done(){
+        return finished;
+    }
+};
+
+// recursive search of a directory tree on several threads, see
+// WorkStealing. Matches are collected in per thread buffers and merged by
+// take(), which may be called while the walk is still running to show
+// results as they come in.
+class TreeWalk{
+    public:
+    struct Found{
+        // index into Result::dirs
+        uint32_t dir;
+        std::string name;
+        Stat stat;
+    };
+
+    struct Result{
+        // directories of found entries relative to the base, empty or
+        // ending with '/'
+        std::vector<std::string> dirs;
+        std::vector<Found> found;
+        // directories that could not be read
+        std::vector<std::string> errors;
+    };
+
+    private:
+    // matches since the last take(), dirs indexed by Found::dir
+    struct Worker{
+        std::mutex resultMutex;
+        Result result;
+    };
+
+    DirReader base;
+    Query query;
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    std::atomic<size_t> dirCount = 0;
+    std::atomic<size_t> entryCount = 0;
+    std::atomic<size_t> matchCount = 0;
+
+    // directories relative to the base, empty or ending with '/'
+    // last so that its threads stop before the members above go away
+    WorkStealing<std::string> walk;
+
+    void visit(size_t w, const std::string& rel){
+        auto& worker = *workers[w];
+        DirReader dir(base.getfd(), rel.length() ? rel.c_str() : ".");
+        if (!dir.ok()){
+            std::lock_guard lock(worker.resultMutex);
+            worker.result.errors.push_back(rel + ": " + strerror(errno));
+            return;
+        }
+
+        std::vector<std::string> children;
+        // d_type decides the walk, lstat is only needed for the size of
+        // matches or when d_type is not filled in
+        StatBatch batch;
+        std::vector<unsigned char> types;
+        std::vector<bool> matched;
+        size_t entries = 0;
+        auto onEntry = [&](const char* name, unsigned char type){
+            entries++;
+            bool m = query.match(name);
+            if (type == DT_DIR){
+                children.push_back(rel + name + '/');
+            }
+            if (m || type == DT_UNKNOWN){
+                batch.add(dir.getfd(), name,
+                    type == DT_UNKNOWN ? Stat::ALL : Stat::SIZE | Stat::TIME);
+                types.push_back(type);
+                matched.push_back(m);
+            }
+        };
+        while (!walk.cancelling() && dir.next(onEntry));
+        dirCount++;
+        entryCount += entries;
+        if (walk.cancelling()){
+            return;
+        }
+        // share subdirectories before the lstat round trip so idle
+        // workers can start on them
+        walk.push(w, children);
+
+        std::vector<Found> found;
+        batch.run([&](size_t i, Stat st){
+            if (types[i] != DT_UNKNOWN){
+                st.mode = DTTOIF(types[i]);
+            }else if (!st.error && S_ISDIR(st.mode)){
+                children.push_back(rel + batch.name(i) + '/');
+            }
+            if (matched[i]){
+                found.push_back({0, batch.name(i), st});
+            }
+        });
+        walk.push(w, children);
+
+        if (found.size()){
+            matchCount += found.size();
+            std::lock_guard lock(worker.resultMutex);
+            uint32_t d = worker.result.dirs.size();
+            worker.result.dirs.push_back(rel);
+            for (auto& f : found){
+                f.dir = d;
+                worker.result.found.push_back(std::move(f));
+            }
+        }
+    }
+
+    public:
+    // path is relative to dirfd
+    TreeWalk(int dirfd, const char* path, const Query& query):
+        base(dirfd, path), query(query) {}
+
+    TreeWalk(const TreeWalk&) = delete;
+    TreeWalk& operator=(const TreeWalk&) = delete;
+
+    bool ok(){
+        return base.ok();
+    }
+
+    // the base directory, open while the walk exists
+    int getfd(){
+        return base.getfd();
+    }
+
+    // start walking the tree on n threads
+    void start(size_t n = workerCount()){
+        std::vector<std::string> root;
+        if (ok()){
+            root.push_back("");
+            for (size_t i = 0; i < std::max<size_t>(n, 1); i++){
+                workers.push_back(std::make_unique<Worker>());
+            }
+        }
+        walk.start(n, root, [this](size_t w, std::string& rel){
+            visit(w, rel);
+        });
+    }
+
+    // stop after the directories being read
+    void cancel(){
+        walk.cancel();
+    }
+
+    // wait up to ms milliseconds for the walk to finish
+    bool wait(int ms){
+        return walk.wait(ms);
+    }
+
+    // every directory is read, or the walk was cancelled
+    bool done(){
+        return walk.done();
+    }
+
+    // directories and entries read so far
+    size_t dirs(){
+        return dirCount;
+    }
+    size_t entries(){
+        return entryCount;
+    }
+    size_t matches(){
+        return matchCount;
+    }
+
+    // matches found since the last call, merged from all workers
+    Result take(){
+        Result merged;
+        for (auto& w : workers){
+            Result r;
+            {
+                std::lock_guard lock(w->resultMutex);
+                std::swap(r, w->result);
+            }
+            uint32_t offset = merged.dirs.size();
+            for (auto& d : r.dirs){
+                merged.dirs.push_back(std::move(d));
+            }
+            for (auto& f : r.found){
+                f.dir += offset;
+                merged.found.push_back(std::move(f));
+            }
+            for (auto& e : r.errors){
+                merged.errors.push_back(std::move(e));
+            }
+        }
+        return merged;
+    }
+};
+
+#endif
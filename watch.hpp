@@ -0,0 +1,143 @@
+#ifndef _WATCH_HPP_
+#define _WATCH_HPP_
+
+#include "config.hpp"
+#include "log.hpp"
+
+// reports names in one directory that changed since the last read
+// events are coalesced by name; callers lstat each name to find out what
+// it looks like now instead of replaying events one by one
+class DirWatch{
+    public:
+    struct Change{
+        std::string name;
+        // content was written, libmagic should look at it again
+        bool written = false;
+    };
+
+    private:
+    int fd = -1;
+    int wd = -1;
+    // the watched directory, for lstat relative to it
+    int dir = -1;
+    // events were dropped or the directory itself went away
+    bool lost = false;
+
+    public:
+    DirWatch(){
+#ifdef __linux__
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd == -1){
+            exitError("inotify_init1");
+        }
+#endif
+    }
+
+    ~DirWatch(){
+        unwatch();
+        if (fd >= 0){
+            close(fd);
+        }
+    }
+
+    DirWatch(const DirWatch&) = delete;
+    DirWatch& operator=(const DirWatch&) = delete;
+
+    void watch(const std::string& path){
+        unwatch();
+#ifdef __linux__
+        if (fd == -1){
+            return;
+        }
+        wd = inotify_add_watch(fd, path.c_str(),
+            IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+            IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE |
+            IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK);
+        if (wd == -1){
+            exitError("inotify_add_watch " + path);
+            return;
+        }
+        dir = open(path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (dir == -1){
+            exitError(path);
+            unwatch();
+        }
+#endif
+    }
+
+    void unwatch(){
+#ifdef __linux__
+        if (wd >= 0){
+            inotify_rm_watch(fd, wd);
+            // drop events still queued for the old directory
+            readChanges();
+        }
+#endif
+        if (dir >= 0){
+            close(dir);
+        }
+        wd = -1;
+        dir = -1;
+        lost = false;
+    }
+
+    bool watching(){
+        return wd >= 0;
+    }
+
+    // fd to poll for readability, -1 if nothing is watched
+    int getfd(){
+        return watching() ? fd : -1;
+    }
+
+    int dirfd(){
+        return dir;
+    }
+
+    // true once events could not be delivered; the listing must be reread
+    bool isLost(){
+        return lost;
+    }
+
+    std::vector<Change> readChanges(){
+        std::vector<Change> changes;
+#ifdef __linux__
+        if (fd == -1){
+            return changes;
+        }
+        std::unordered_map<std::string, size_t> seen;
+        alignas(inotify_event) char buf[1 << 16];
+        while (true){
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0){
+                break;
+            }
+            for (ssize_t off = 0; off < n;){
+                auto event = (inotify_event*)(buf + off);
+                off += sizeof(inotify_event) + event->len;
+
+                if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF |
+                    IN_MOVE_SELF | IN_UNMOUNT))
+                {
+                    lost = true;
+                }
+                if (event->wd != wd || !event->len){
+                    continue;
+                }
+                std::string name = event->name;
+                auto found = seen.find(name);
+                if (found == seen.end()){
+                    found = seen.emplace(name, changes.size()).first;
+                    changes.push_back({name});
+                }
+                if (event->mask & (IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO)){
+                    changes[found->second].written = true;
+                }
+            }
+        }
+#endif
+        return changes;
+    }
+};
+
+#endif
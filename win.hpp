@@ -2,6 +2,7 @@
 #define _WIN_HPP_
 
 #include "controller.hpp"
+#include "layout.hpp"
 
 class Win{
     public:
@@ -11,25 +12,118 @@ class Win{
         }align;
         bool standout = false;
         bool underline = false;
+
+        bool operator==(const Attr&) const = default;
     };
-    
+
+    // str points into the arena of the frame it belongs to, or to static
+    // storage
     struct Col{
-        std::string str;
+        std::string_view str;
         Attr attr;
         float wp;
+
+        bool operator==(const Col&) const = default;
     };
-    
-    using Line = std::vector<Col>;
+
+    using Line = std::pmr::vector<Col>;
+    using Lines = std::pmr::vector<Line>;
     using enum Attr::Align;
-    
+
     private:
     size_t h, w;
-    std::vector<Col> header;
-    std::vector<Col> footer;
-    std::vector<Line> entries;
-    std::vector<size_t> selected;
-    size_t scroll = 0;
-    
+
+    // everything a frame is made of, strings included, is allocated from
+    // its arena. Two frames are alive at a time: the one on screen, which
+    // the next is compared with, and the one being built; building a frame
+    // releases the arena of the frame before the one on screen.
+    struct Frame{
+        std::vector<std::byte> buffer;
+        std::pmr::monotonic_buffer_resource arena;
+        Line header;
+        Line footer;
+        Lines entries;
+        // rows of the screen, and where the file list was
+        Lines rows;
+        size_t top = 0, bottom = 0;
+
+        Frame(size_t size):
+            buffer(size), arena(buffer.data(), buffer.size()),
+            header(&arena), footer(&arena), entries(&arena), rows(&arena) {}
+
+        void reset(){
+            // give up the vectors before their memory
+            header = Line(&arena);
+            footer = Line(&arena);
+            entries = Lines(&arena);
+            rows = Lines(&arena);
+            arena.release();
+            top = bottom = 0;
+        }
+    };
+    std::unique_ptr<Frame> frames[2];
+    // frames[current] is being built, the other one is on screen
+    int current = 0;
+    // heap allocations before setUI(), to log those of a frame
+    size_t allocationsBefore = 0;
+
+    // name and size columns of entries, formatted once
+    // they are wrapped, numbered and given attributes every frame
+    struct FormattedRow{
+        // what the row was formatted from
+        off_t size;
+        File::Type type;
+        std::string name;
+        std::string sizeStr;
+    };
+    std::unordered_map<size_t, FormattedRow> rows;
+    // rows are valid for this table
+    uint64_t rowsTable = 0;
+    // rows kept at most, far more than a screen
+    static constexpr size_t ROW_CACHE_SIZE = 4096;
+
+    // lines every row of the list wraps into, to scroll by lines
+    RowLayout layout;
+    // what layout was built from
+    uint64_t layoutTable = 0;
+    uint64_t layoutVersion = 0;
+    size_t layoutNameWidth = 0, layoutSizeWidth = 0;
+    // row of each file index in layout, npos if it is not listed
+    std::vector<size_t> layoutRows;
+
+    Frame& frame(){
+        return *frames[current];
+    }
+
+    std::pmr::memory_resource* arena(){
+        return &frame().arena;
+    }
+
+    // copy of parts joined, in the arena of the frame
+    std::string_view text(std::initializer_list<std::string_view> parts){
+        size_t length = 0;
+        for (auto p : parts){
+            length += p.length();
+        }
+        auto buf = (char*)arena()->allocate(length, 1);
+        size_t at = 0;
+        for (auto p : parts){
+            memcpy(buf + at, p.data(), p.length());
+            at += p.length();
+        }
+        return std::string_view(buf, length);
+    }
+
+    std::string_view number(size_t n){
+        char buf[24];
+        auto end = std::to_chars(buf, buf + sizeof(buf), n).ptr;
+        return text({ std::string_view(buf, end - buf) });
+    }
+
+    Line line(std::initializer_list<Col> cols){
+        return Line(cols, arena());
+    }
+
     void print(size_t y, const Line& line){
         size_t x = 0;
         float accColWidth = 0;
@@ -43,113 +137,212 @@ class Win{
                         - col.str.length();
                     break;
             }
-            
+
             if (col.attr.standout) standout();
             if (col.attr.underline) attron(A_UNDERLINE);
-            mvprintw(y, x, "%s", col.str.c_str());
+            mvaddnstr(y, x, col.str.data(), col.str.length());
             standend();
             accColWidth += col.wp;
         }
     }
-    
-    void printSeparator(size_t y, char c){
-        for (int i = 0; i < w; i++){
-            mvprintw(y, i, "%c", c);
+
+    Line separator(char c){
+        auto buf = (char*)arena()->allocate(w, 1);
+        memset(buf, c, w);
+        return line({ { std::string_view(buf, w), { LEFT }, 1 } });
+    }
+
+    // rows of the list in [top, bottom) that moved a few rows since the
+    // last frame are shifted with a scroll region, so the terminal
+    // scrolls them instead of being sent every row again
+    void scrollList(Frame& next, Frame& shown){
+        size_t top = next.top, bottom = next.bottom;
+        const auto& frame = next.rows;
+        if (top != shown.top || bottom != shown.bottom ||
+            shown.rows.size() != frame.size() || bottom <= top)
+        {
+            return;
+        }
+        long n = bottom - top;
+        // rows of frame already on screen if the list moved by d
+        auto matches = [&](long d){
+            size_t count = 0;
+            for (long y = top; y < (long)bottom; y++){
+                long from = y + d;
+                if (from >= (long)top && from < (long)bottom &&
+                    frame[y].size() && shown.rows[from] == frame[y])
+                {
+                    count++;
+                }
+            }
+            return count;
+        };
+        long best = 0;
+        size_t bestCount = matches(0);
+        for (long d = 1; d <= n / 2; d++){
+            for (long s : { d, -d }){
+                size_t count = matches(s);
+                if (count > bestCount){
+                    best = s;
+                    bestCount = count;
+                }
+            }
+        }
+        if (!best){
+            return;
+        }
+        setscrreg(top, bottom - 1);
+        scrollok(stdscr, TRUE);
+        scrl(best);
+        scrollok(stdscr, FALSE);
+        setscrreg(0, h - 1);
+        // same for the rows kept, rows scrolled in are blank
+        auto begin = shown.rows.begin() + top;
+        auto end = shown.rows.begin() + bottom;
+        if (best > 0){
+            std::rotate(begin, begin + best, end);
+            std::for_each(end - best, end, [](Line& l){ l.clear(); });
+        }else{
+            std::rotate(begin, end + best, end);
+            std::for_each(begin, begin - best, [](Line& l){ l.clear(); });
         }
     }
-    
+
     // check file type and add suffix:
     // dir: '/'
     // executable: '*'
     // symlink: "-> (resolve)"
-    std::string suffixByFileType(const File& file){
+    std::string suffixByFileType(const EntryRef& file){
         std::string suffix;
-        switch (file.type){
+        switch (file.type()){
             using enum File::Type;
             case DIR: suffix = "/"; break;
             case EXE: suffix = "*"; break;
             case REG: suffix = ""; break;
-            case SYM: suffix = " -> " + file.sym; break;
+            case SYM: suffix = " -> " + file.sym(); break;
             case UKN: suffix = ""; break;
         }
         return suffix;
     }
-    
-    // change from bytes to KB / MB / GB / TB
-    std::string fileSizeStr(const File& file){
-        float size = file.size;
-        const std::vector<std::string> units = {
-            "B", "KB", "MB", "GB", "TB"
-        };
-        
-        size_t i = log2(size)/10;
-        char buf[100];
-        sprintf(buf, "%.1f %s", size/(pow(1024, i)), units[i].c_str());
-        return buf;
+
+    size_t suffixLength(const EntryRef& file){
+        switch (file.type()){
+            using enum File::Type;
+            case DIR: return 1;
+            case EXE: return 1;
+            case SYM: return 4 + file.sym().length();
+            default: return 0;
+        }
     }
-    
-    std::vector<Col> divideCol(const Col& col){
-        std::vector<Col> cols;
-        size_t width = col.wp * w;
-
-        for (size_t x = 0; x < col.str.length(); x += width){
-            auto begin = col.str.begin() + x;
-            auto end = x + width < col.str.length() ?
-                col.str.begin() + x + width :
-                col.str.end();
-            cols.push_back({
-                std::string(begin, end),
-                col.attr,
-                col.wp
-            });
+
+    // cached row of file, formatted again if it changed
+    const FormattedRow& formatRow(const EntryRef& file){
+        auto found = rows.find(file.index());
+        if (found != rows.end() && found->second.size == file.size() &&
+            found->second.type == file.type())
+        {
+            return found->second;
         }
+        if (rows.size() >= ROW_CACHE_SIZE){
+            rows.clear();
+        }
+        auto& row = rows[file.index()];
+        row = {
+            file.size(),
+            file.type(),
+            file.displayName() + suffixByFileType(file),
+            fileSizeStr(file.size()),
+        };
+        return row;
+    }
 
-        return cols;
+    // k-th piece of str cut into pieces of width, empty past the end
+    static std::string_view piece(std::string_view str, size_t width,
+        size_t k)
+    {
+        return k * width < str.length() ?
+            str.substr(k * width, width) : std::string_view();
     }
-    
-    std::vector<Line> divideLine(const Line& line){
-        std::vector<Line> lines;
-        std::vector<std::vector<Col>> cols;
-        
-        for (const auto& col : line){
-            cols.push_back(divideCol(col));
-        }
-        // empty line?
-        if (!cols.size() || !cols[0].size()) {
-            return lines;
+
+    static size_t pieces(std::string_view str, size_t width){
+        return (str.length() + width - 1) / width;
+    }
+
+    // lines the row of file wraps into, as formatRow() would format it
+    size_t rowHeight(const EntryRef& file, size_t nameWidth,
+        size_t sizeWidth)
+    {
+        size_t name = file.relativeDir().length() + file.name().length() +
+            suffixLength(file);
+        size_t height = (name + nameWidth - 1) / nameWidth;
+        // sizes are shorter than "1024.0 TB" and rarely wrap
+        if (sizeWidth < 12){
+            height = std::max(height,
+                pieces(fileSizeStr(file.size()), sizeWidth));
         }
+        return std::max<size_t>(height, 1);
+    }
 
-        size_t maxNoOfLines = 0;
-        std::for_each(cols.begin(), cols.end(),
-            [&](const auto& col){
-                if (col.size() > maxNoOfLines){
-                    maxNoOfLines = col.size();
-                }
-            });
-        for (size_t i = 0; i < maxNoOfLines; i++){
-            Line l;
-            for (const auto& c : cols){
-                if (i >= c.size()){
-                    l.push_back({"", c[0].attr, c[0].wp});
-                }else{
-                    l.push_back(c[i]);
+    // bring layout up to date with files
+    // built again when the list changed, else only changed rows are
+    // measured again
+    void updateLayout(const Explorer::View& files, size_t nameWidth,
+        size_t sizeWidth)
+    {
+        if (files.generation() != layoutTable ||
+            files.version() != layoutVersion ||
+            nameWidth != layoutNameWidth || sizeWidth != layoutSizeWidth)
+        {
+            layoutTable = files.generation();
+            layoutVersion = files.version();
+            layoutNameWidth = nameWidth;
+            layoutSizeWidth = sizeWidth;
+            std::vector<size_t> heights(files.size());
+            layoutRows.clear();
+            for (size_t r = 0; r < files.size(); r++){
+                auto file = files[r];
+                heights[r] = rowHeight(file, nameWidth, sizeWidth);
+                if (file.index() >= layoutRows.size()){
+                    layoutRows.resize(file.index() + 1, -1);
                 }
+                layoutRows[file.index()] = r;
+            }
+            layout.assign(std::move(heights));
+            return;
+        }
+        for (auto i : files.changed()){
+            if (i >= layoutRows.size() || layoutRows[i] == (size_t)-1){
+                continue;
             }
-            lines.push_back(l);
+            size_t r = layoutRows[i];
+            layout.setHeight(r, rowHeight(files[r], nameWidth, sizeWidth));
         }
+    }
 
-        return lines;
+    Line divideCol(const Col& col){
+        Line cols(arena());
+        size_t width = std::max<size_t>(col.wp * w, 1);
+        for (size_t k = 0; k < pieces(col.str, width); k++){
+            cols.push_back({ piece(col.str, width, k), col.attr, col.wp });
+        }
+        return cols;
     }
-    
+
     /*
      * header:
      * File Explorer
      *   explorer.getcwd()
      *   (number) entries
+     *   (number) selected, (size) if any
+     *   explorer.diskUsage() in disk usage mode
      *   Sort by: explorer.sortBy()
-     * 
+     *
      * footer:
      * control.getFooter()
+     * explorer.searchProgress() while searching
+     * explorer.indexProgress() while indexing
+     * explorer.usageProgress() while counting disk usage
+     * explorer.jobsStatus() while jobs run
      * ERROR_STR || control.getBuf()
      */
     public:
@@ -157,24 +350,72 @@ class Win{
         if (control.isresize()){
             gethw();
         }
+        if (ENABLE_LOGGING){
+            allocationsBefore = heapAllocations;
+        }
+        frame().reset();
 
-        auto files = explorer.getFiles();
+        // only the rows on screen are read
+        auto files = explorer.view();
         // header
         pushHeader(divideCol({"File Explorer", { LEFT }, 1}));
-        pushHeader(divideCol({"  " + explorer.getcwd(), { LEFT }, 1}));
-        pushHeader(divideCol({
-            "  " +  std::to_string(files.size()) + " Files",
-            { LEFT },
-            1
-        }));
+        pushHeader(divideCol({text({"  ", explorer.getcwd()}), { LEFT }, 1}));
+        if (explorer.loading()){
+            pushHeader(divideCol({
+                text({
+                    "  loading ", number(explorer.loadingCount()),
+                    " entries..."
+                }),
+                { LEFT },
+                1
+            }));
+        }else{
+            pushHeader(divideCol({
+                text({"  ", number(files.size()), " Files"}),
+                { LEFT },
+                1
+            }));
+        }
+        if (explorer.selectedCount()){
+            pushHeader(divideCol({
+                text({
+                    "  ", number(explorer.selectedCount()), " selected, ",
+                    fileSizeStr(explorer.selectedSize())
+                }),
+                { LEFT },
+                1
+            }));
+        }
+        auto usageStr = explorer.diskUsage();
+        if (usageStr != ""){
+            pushHeader(divideCol({text({"  ", usageStr}), { LEFT }, 1}));
+        }
         auto sortByStr = explorer.sortBy();
         if (sortByStr != ""){
-            auto fullStr = "  Sort by: " + explorer.sortBy();
+            auto fullStr = text({"  Sort by: ", sortByStr});
             pushHeader(divideCol({fullStr, { LEFT }, 1}));
         }
 
         // footer
-        pushFooter(divideCol({control.getMsg(), { LEFT }, 1}));
+        pushFooter(divideCol({text({control.getMsg()}), { LEFT }, 1}));
+        if (explorer.searching()){
+            pushFooter(divideCol({
+                text({explorer.searchProgress()}), { LEFT }, 1
+            }));
+        }
+        if (explorer.indexProgress() != ""){
+            pushFooter(divideCol({
+                text({explorer.indexProgress()}), { LEFT }, 1
+            }));
+        }
+        if (explorer.usageProgress() != ""){
+            pushFooter(divideCol({
+                text({explorer.usageProgress()}), { LEFT }, 1
+            }));
+        }
+        for (const auto& job : explorer.jobsStatus()){
+            pushFooter(divideCol({text({job}), { LEFT }, 1}));
+        }
         if (ERROR_STR != ""){
             // trim beginning spaces
             auto begin =
@@ -183,134 +424,197 @@ class Win{
                     ERROR_STR.begin();
             ERROR_STR = std::string(begin , ERROR_STR.end());
 
-            pushFooter(divideCol({ERROR_STR, { LEFT }, 1}));
+            pushFooter(divideCol({text({ERROR_STR}), { LEFT }, 1}));
             ERROR_STR = "";
         }else{
-            pushFooter(divideCol({control.getBuf(), { RIGHT }, 1}));
+            pushFooter(divideCol({text({control.getBuf()}), { RIGHT }, 1}));
         }
-        
-        // scrolling
-        size_t centreHeight = h - header.size() - footer.size() - 2;
-        if (explorer.getCur() >= scroll + centreHeight){
-            scroll = explorer.getCur()-centreHeight+1;
-        }else if (explorer.getCur() < scroll){
-            scroll = explorer.getCur();
-        }
-        FElog.add("centreHeight: " + std::to_string(centreHeight));
-        FElog.add("scroll: " + std::to_string(scroll));
-        FElog.add("cursor: " + std::to_string(explorer.getCur()));
 
         float lineNoWidth = (log10(files.size()) + 3) / w;
-        std::vector<float> colWidths;
-        const auto NUM_OF_COL = sizeof(COL_WIDTHS)/sizeof(*COL_WIDTHS);
+        constexpr auto NUM_OF_COL = sizeof(COL_WIDTHS)/sizeof(*COL_WIDTHS);
+        std::array<float, NUM_OF_COL> colWidths;
         for (size_t i = 0; i < NUM_OF_COL;  i++){
-            colWidths.push_back(COL_WIDTHS[i]*(1-lineNoWidth));
+            colWidths[i] = COL_WIDTHS[i]*(1-lineNoWidth);
+        }
+        if (files.generation() != rowsTable){
+            rows.clear();
+            rowsTable = files.generation();
+        }
+        size_t nameWidth = std::max<size_t>(colWidths[0] * w, 1);
+        size_t sizeWidth = std::max<size_t>(colWidths[1] * w, 1);
+        updateLayout(files, nameWidth, sizeWidth);
+        explorer.forgetChangedRows();
+
+        // scrolling, by lines since long names take several
+        // scroll is the first row on screen, the cursor row is kept on
+        // screen as a whole unless it is higher than the screen
+        size_t cur = explorer.getCur();
+        size_t scroll = std::min<size_t>(explorer.getScroll(), cur);
+        size_t centreHeight =
+            h - frame().header.size() - frame().footer.size() - 2;
+        if (files.size()){
+            size_t curBottom = layout.lineOf(cur + 1);
+            if (curBottom > layout.lineOf(scroll) + centreHeight){
+                // first row that starts at or below the line that puts the
+                // bottom of the cursor row at the bottom of the screen
+                size_t line = curBottom - centreHeight;
+                scroll = layout.rowAt(line);
+                if (layout.lineOf(scroll) < line){
+                    scroll++;
+                }
+                scroll = std::min(scroll, cur);
+            }
         }
-        // get all files and format the names
+        explorer.setScroll(scroll);
+        size_t end = std::min(files.size(),
+            layout.rowAt(layout.lineOf(scroll) + centreHeight - 1) + 1);
+        explorer.classifyVisible(scroll, end);
+
+        // format the names, or take them from the cache, and wrap them
         // | num | file name (with suffix) | size |
-        for (size_t i = scroll;
-            i < files.size() && i - scroll < centreHeight;
-            i++)
-        {
-            const auto& file = files[i];
+        for (size_t i = scroll; i < end; i++){
+            auto file = files[i];
             bool standout = explorer.getCur() == i;
-            bool underline = file.selected;
-            auto name = file.name + suffixByFileType(file);
-            Line line = {
-                {
-                    std::to_string(i) + ')',
-                    { LEFT, standout, underline  },
-                    lineNoWidth
-                },
-                {
-                    name,
-                    { LEFT, standout, underline },
-                    colWidths[0]
-                },
-                {
-                    fileSizeStr(file),
-                    { RIGHT, standout, underline },
-                    colWidths[1]
-                },
-            };
-            pushFiles(divideLine(line));
-            centreHeight = h - header.size() - footer.size() - 2;
-        }
-        
+            bool underline = files.selected(i);
+            const auto& row = formatRow(file);
+            std::string_view name = text({row.name});
+            std::string_view size = text({row.sizeStr});
+            size_t height = std::max(pieces(name, nameWidth),
+                pieces(size, sizeWidth));
+            // names of rows formatted before they were classified
+            if (height != layout.height(i)){
+                layout.setHeight(i, height);
+            }
+            for (size_t k = 0; k < height; k++){
+                pushFiles(line({
+                    {
+                        k ? "" : text({number(i), ")"}),
+                        { LEFT, standout, underline },
+                        lineNoWidth
+                    },
+                    {
+                        piece(name, nameWidth, k),
+                        { LEFT, standout, underline },
+                        colWidths[0]
+                    },
+                    {
+                        piece(size, sizeWidth, k),
+                        { RIGHT, standout, underline },
+                        colWidths[1]
+                    },
+                }));
+            }
+        }
+
         return *this;
     }
 
+    // only rows that differ from the last frame are printed, and the
+    // terminal is updated once through doupdate()
     Win& draw(){
-        clear();
+        auto& next = frame();
+        auto& shown = *frames[1 - current];
+        const auto& header = next.header;
+        const auto& footer = next.footer;
+        const auto& entries = next.entries;
         size_t centreHeight = h - header.size() - footer.size() - 2;
+        auto& screen = next.rows;
+        screen.assign(h, Line(arena()));
         size_t y = 0;
+        auto put = [&](const Line& line){
+            if (y < h){
+                screen[y] = line;
+            }
+            y++;
+        };
 
         // header
         for (const auto& s : header){
-            print(y, {s});
-            y++;
+            put(line({s}));
         }
-
-        printSeparator(y, '-');
-        y++;
+        put(separator('-'));
 
         // files
-        // set scroll
+        next.top = y;
         for (size_t i = 0; i < centreHeight; i++){
             if (i >= entries.size()) break;
-            print(y, entries[i]);
-            y++;
+            put(entries[i]);
         }
 
         // footer
         // footer may cover the already printed lines
         y = h - footer.size()-1;
-        printSeparator(y, '-');
-        y++;
-
+        next.bottom = y;
+        put(separator('-'));
         for (const auto& s : footer){
-            print(y, {s});
-            y++;
+            put(line({s}));
+        }
+
+        scrollList(next, shown);
+        for (y = 0; y < h; y++){
+            if (y < shown.rows.size() && shown.rows[y] == screen[y]){
+                continue;
+            }
+            move(y, 0);
+            clrtoeol();
+            print(y, screen[y]);
         }
 
-        refresh();
-        header.clear();
-        footer.clear();
-        entries.clear();
+        wnoutrefresh(stdscr);
+        doupdate();
+        current = 1 - current;
+        if (ENABLE_LOGGING){
+            // the log itself allocates, count first
+            size_t allocations = heapAllocations - allocationsBefore;
+            FElog.add("frame: " + std::to_string(allocations) +
+                " heap allocations");
+        }
         return *this;
     }
-    
-    Win& pushHeader(const std::vector<Col>& header){
-        this->header.insert(this->header.end(), header.begin(), header.end());
+
+    Win& pushHeader(const Line& header){
+        auto& to = frame().header;
+        to.insert(to.end(), header.begin(), header.end());
         return *this;
     }
     Win& pushHeader(const Col& header){
-        this->header.push_back(header);
+        frame().header.push_back(header);
         return *this;
     }
-    
-    Win& pushFooter(const std::vector<Col>& footer){
-        this->footer.insert(this->footer.end(), footer.begin(), footer.end());
+
+    Win& pushFooter(const Line& footer){
+        auto& to = frame().footer;
+        to.insert(to.end(), footer.begin(), footer.end());
         return *this;
     }
     Win& pushFooter(const Col& footer){
-        this->footer.push_back(footer);
+        frame().footer.push_back(footer);
         return *this;
     }
-    
-    Win& pushFiles(const std::vector<Line>& files){
-        this->entries.insert(this->entries.end(), files.begin(), files.end());
+
+    Win& pushFiles(const Lines& files){
+        auto& to = frame().entries;
+        to.insert(to.end(), files.begin(), files.end());
         return *this;
     }
     Win& pushFiles(const Line& files){
-        this->entries.push_back(files);
+        frame().entries.push_back(files);
         return *this;
     }
-    
+
     Win& gethw(){
         getmaxyx(stdscr, h, w);
         FElog.add("h: " + std::to_string(h));
         FElog.add("w: " + std::to_string(w));
+        // a frame is a few copies of the screen plus its vectors, more
+        // only comes from the heap while the screen is unusually busy
+        size_t size = std::max<size_t>(1 << 16, h * (w + 256) * 4);
+        for (auto& f : frames){
+            f = std::make_unique<Frame>(size);
+        }
+        // everything moves on resize, start from a blank screen
+        erase();
+        clearok(curscr, TRUE);
         return *this;
     }
 };